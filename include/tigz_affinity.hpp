@@ -0,0 +1,169 @@
+// BSD 3-Clause License
+//
+// Copyright (c) 2023, Tommi Mäklin
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from
+//    this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+#ifndef TIGZ_TIGZ_AFFINITY_HPP
+#define TIGZ_TIGZ_AFFINITY_HPP
+
+#include <cstddef>
+#include <vector>
+#include <string>
+#include <fstream>
+#include <algorithm>
+#include <stdexcept>
+#include <system_error>
+#include <thread>
+#include <cerrno>
+#include <cctype>
+
+#include <sched.h>
+
+namespace tigz {
+// CPUs in a list like "0-3,8,10-11", the format of taskset -c and of
+// the cpulist files in sysfs
+inline std::vector<int> parse_cpu_list(const std::string &list) {
+    std::vector<int> cpus;
+    size_t pos = 0;
+    while (pos < list.size()) {
+	size_t end = list.find(',', pos);
+	if (end == std::string::npos) {
+	    end = list.size();
+	}
+	std::string range = list.substr(pos, end - pos);
+	range.erase(std::remove_if(range.begin(), range.end(), ::isspace), range.end());
+	if (!range.empty()) {
+	    size_t dash = range.find('-');
+	    size_t n_chars_first = 0;
+	    size_t n_chars_last = 0;
+	    int first = -1;
+	    int last = -1;
+	    try {
+		first = std::stoi(range.substr(0, dash), &n_chars_first);
+		last = (dash == std::string::npos ? first : std::stoi(range.substr(dash + 1), &n_chars_last));
+	    } catch (const std::exception &) {
+		throw std::invalid_argument("invalid CPU list `" + list + "`.");
+	    }
+	    bool bad_chars = (n_chars_first != range.substr(0, dash).size() ||
+			      (dash != std::string::npos && n_chars_last != range.size() - dash - 1));
+	    if (bad_chars || first < 0 || last < first) {
+		throw std::invalid_argument("invalid CPU list `" + list + "`.");
+	    }
+	    for (int cpu = first; cpu <= last; ++cpu) {
+		cpus.push_back(cpu);
+	    }
+	}
+	pos = end + 1;
+    }
+    std::sort(cpus.begin(), cpus.end());
+    cpus.erase(std::unique(cpus.begin(), cpus.end()), cpus.end());
+    return cpus;
+}
+
+// CPUs of the NUMA nodes in `nodes`, a list in the same format
+inline std::vector<int> numa_node_cpus(const std::string &nodes) {
+    std::vector<int> cpus;
+    for (int node : parse_cpu_list(nodes)) {
+	std::ifstream cpulist("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+	std::string list;
+	if (!std::getline(cpulist, list)) {
+	    throw std::invalid_argument("NUMA node " + std::to_string(node) + " does not exist.");
+	}
+	std::vector<int> node_cpus = parse_cpu_list(list);
+	cpus.insert(cpus.end(), node_cpus.begin(), node_cpus.end());
+    }
+    std::sort(cpus.begin(), cpus.end());
+    cpus.erase(std::unique(cpus.begin(), cpus.end()), cpus.end());
+    return cpus;
+}
+
+// Number of CPUs the calling thread may run on. This respects taskset
+// and cgroup cpusets unlike std::thread::hardware_concurrency, which
+// counts every CPU in the machine.
+inline size_t available_cpu_count() {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0 && CPU_COUNT(&set) > 0) {
+	return CPU_COUNT(&set);
+    }
+    return std::max(std::thread::hardware_concurrency(), 1u);
+}
+
+// Restrict the calling thread to `cpus`. Threads that it starts
+// afterwards inherit the restriction.
+inline void set_thread_cpus(const std::vector<int> &cpus) {
+    if (cpus.empty()) {
+	return;
+    }
+    int max_cpu = *std::max_element(cpus.begin(), cpus.end());
+    cpu_set_t *set = CPU_ALLOC(max_cpu + 1);
+    if (set == nullptr) {
+	throw std::bad_alloc();
+    }
+    size_t set_nbytes = CPU_ALLOC_SIZE(max_cpu + 1);
+    CPU_ZERO_S(set_nbytes, set);
+    for (int cpu : cpus) {
+	CPU_SET_S(cpu, set_nbytes, set);
+    }
+    int result = sched_setaffinity(0, set_nbytes, set);
+    int error = errno;
+    CPU_FREE(set);
+    if (result != 0) {
+	throw std::system_error(error, std::generic_category(), "can't run on the given CPUs");
+    }
+}
+
+// Restricts the calling thread to `cpus` for the lifetime of the object,
+// so that the threads started meanwhile (e.g. by rapidgzip) run on them.
+// Does nothing if `cpus` is empty.
+class ScopedThreadCpus {
+private:
+    bool restore = false;
+    cpu_set_t previous;
+
+public:
+    ScopedThreadCpus(const std::vector<int> &cpus) {
+	if (!cpus.empty() && sched_getaffinity(0, sizeof(this->previous), &this->previous) == 0) {
+	    set_thread_cpus(cpus);
+	    this->restore = true;
+	}
+    }
+
+    ~ScopedThreadCpus() {
+	if (this->restore) {
+	    sched_setaffinity(0, sizeof(this->previous), &this->previous);
+	}
+    }
+
+    // Delete copy constructor & copy assignment operator
+    ScopedThreadCpus(const ScopedThreadCpus& other) = delete;
+    ScopedThreadCpus& operator=(const ScopedThreadCpus& other) = delete;
+};
+}
+
+#endif
@@ -0,0 +1,289 @@
+// BSD 3-Clause License
+//
+// Copyright (c) 2023, Tommi Mäklin
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from
+//    this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+#ifndef TIGZ_TIGZ_BUFFER_POOL_HPP
+#define TIGZ_TIGZ_BUFFER_POOL_HPP
+
+#include <cstddef>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <new>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace tigz {
+class BufferPool;
+
+// Page-aligned memory that is not initialised. A buffer taken from a
+// BufferPool goes back to the pool when it is destroyed or replaced.
+class Buffer {
+private:
+    friend class BufferPool;
+
+    char *memory = nullptr;
+    size_t capacity = 0;
+    std::shared_ptr<BufferPool> pool;
+
+    Buffer(char *_memory, size_t _capacity, std::shared_ptr<BufferPool> _pool)
+	: memory(_memory), capacity(_capacity), pool(std::move(_pool)) {}
+
+    void reset();
+
+public:
+    Buffer() = default;
+    ~Buffer() {
+	this->reset();
+    }
+
+    Buffer(Buffer&& other) noexcept
+	: memory(other.memory), capacity(other.capacity), pool(std::move(other.pool)) {
+	other.memory = nullptr;
+	other.capacity = 0;
+    }
+    Buffer& operator=(Buffer&& other) noexcept {
+	if (this != &other) {
+	    this->reset();
+	    this->memory = other.memory;
+	    this->capacity = other.capacity;
+	    this->pool = std::move(other.pool);
+	    other.memory = nullptr;
+	    other.capacity = 0;
+	}
+	return *this;
+    }
+
+    // Delete copy constructor & copy assignment operator
+    Buffer(const Buffer& other) = delete;
+    Buffer& operator=(const Buffer& other) = delete;
+
+    char* data() const {
+	return this->memory;
+    }
+    size_t size() const {
+	return this->capacity;
+    }
+};
+
+// Pool of buffers shared by compressors and decompressors. The memory
+// of the buffers in use and of the cached free buffers stays within
+// `limit_nbytes` (no limit if 0): taking a buffer waits until others
+// are returned instead. Without a limit, at most `max_cached_nbytes`
+// of free buffers are kept. Create the pool with std::make_shared.
+class BufferPool : public std::enable_shared_from_this<BufferPool> {
+private:
+    friend class Buffer;
+
+    struct Allocation {
+	char *memory;
+	size_t nbytes;
+    };
+
+    size_t limit_nbytes;
+    bool huge_pages;
+
+    mutable std::mutex mutex;
+    std::condition_variable returned;
+
+    // Memory of the buffers in use and in `cached`, and of `cached`
+    size_t allocated_nbytes = 0;
+    size_t cached_nbytes = 0;
+    size_t n_in_use = 0;
+    std::vector<Allocation> cached;
+
+    static constexpr size_t huge_page_nbytes = 2097152;
+
+    // Free buffers kept without a limit: about the ring of a compressor
+    // with the largest blocks that `set_auto_block_size` chooses
+    static constexpr size_t max_cached_nbytes = 536870912;
+
+    Allocation allocate(size_t nbytes) const {
+	static const size_t page_nbytes = sysconf(_SC_PAGESIZE);
+	bool huge = (this->huge_pages && nbytes >= huge_page_nbytes);
+	size_t alignment = (huge ? huge_page_nbytes : page_nbytes);
+	nbytes = (nbytes + alignment - 1)/alignment*alignment;
+
+	// Anonymous mappings are only backed by memory once written to
+	void *memory = mmap(nullptr, nbytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (memory == MAP_FAILED) {
+	    throw std::bad_alloc();
+	}
+#ifdef MADV_HUGEPAGE
+	if (huge) {
+	    madvise(memory, nbytes, MADV_HUGEPAGE);
+	}
+#endif
+	return Allocation{ static_cast<char*>(memory), nbytes };
+    }
+
+    void free_cached(size_t i) {
+	munmap(this->cached[i].memory, this->cached[i].nbytes);
+	this->allocated_nbytes -= this->cached[i].nbytes;
+	this->cached_nbytes -= this->cached[i].nbytes;
+	this->cached[i] = this->cached.back();
+	this->cached.pop_back();
+    }
+
+    // Index of the smallest cached buffer; `cached` must not be empty
+    size_t smallest_cached() const {
+	size_t smallest = 0;
+	for (size_t i = 1; i < this->cached.size(); ++i) {
+	    if (this->cached[i].nbytes < this->cached[smallest].nbytes) {
+		smallest = i;
+	    }
+	}
+	return smallest;
+    }
+
+    // Take the smallest cached buffer that fits `nbytes` or allocate a
+    // new one. Called with the mutex held. Returns false if the buffer
+    // would not fit in the limit and `exceed_limit` is false.
+    bool take(size_t nbytes, bool exceed_limit, Allocation *allocation) {
+	size_t best = this->cached.size();
+	for (size_t i = 0; i < this->cached.size(); ++i) {
+	    if (this->cached[i].nbytes >= nbytes && (best == this->cached.size() || this->cached[i].nbytes < this->cached[best].nbytes)) {
+		best = i;
+	    }
+	}
+	if (best < this->cached.size()) {
+	    *allocation = this->cached[best];
+	    this->cached_nbytes -= allocation->nbytes;
+	    this->cached[best] = this->cached.back();
+	    this->cached.pop_back();
+	    ++this->n_in_use;
+	    return true;
+	}
+
+	// None of the cached buffers fit. They stay cached for smaller
+	// requests unless the new buffer would go over the limit; then they
+	// are dropped, the smallest first, until it fits.
+	while (this->limit_nbytes > 0 && this->allocated_nbytes + nbytes > this->limit_nbytes && !this->cached.empty()) {
+	    this->free_cached(this->smallest_cached());
+	}
+	if (this->limit_nbytes > 0 && this->allocated_nbytes + nbytes > this->limit_nbytes && this->n_in_use > 0 && !exceed_limit) {
+	    return false;
+	}
+
+	*allocation = this->allocate(nbytes);
+	this->allocated_nbytes += allocation->nbytes;
+	++this->n_in_use;
+	return true;
+    }
+
+    void give_back(char *memory, size_t nbytes) {
+	{
+	    std::lock_guard<std::mutex> lock(this->mutex);
+	    this->cached.push_back(Allocation{ memory, nbytes });
+	    this->cached_nbytes += nbytes;
+	    --this->n_in_use;
+	    // Buffers allocated over the limit are freed when they return
+	    while (this->limit_nbytes > 0 && this->allocated_nbytes > this->limit_nbytes && !this->cached.empty()) {
+		this->free_cached(this->cached.size() - 1);
+	    }
+	    while (this->limit_nbytes == 0 && this->cached_nbytes > max_cached_nbytes) {
+		this->free_cached(this->smallest_cached());
+	    }
+	}
+	this->returned.notify_all();
+    }
+
+public:
+    explicit BufferPool(size_t _limit_nbytes = 0, bool _huge_pages = false)
+	: limit_nbytes(_limit_nbytes), huge_pages(_huge_pages) {}
+
+    ~BufferPool() {
+	while (!this->cached.empty()) {
+	    this->free_cached(this->cached.size() - 1);
+	}
+    }
+
+    // Delete copy and move constructors & copy and move assignment operators
+    BufferPool(const BufferPool& other) = delete;
+    BufferPool(BufferPool&& other) = delete;
+    BufferPool& operator=(const BufferPool& other) = delete;
+    BufferPool& operator=(const BufferPool&& other) = delete;
+
+    // Take a buffer of at least `nbytes`, waiting while it would not fit
+    // in the limit. A caller that holds no other buffers from the pool
+    // can set `exceed_limit` so that it can always make progress; the
+    // memory over the limit is freed when the buffer is returned.
+    Buffer acquire(size_t nbytes, bool exceed_limit = false) {
+	Allocation allocation;
+	{
+	    std::unique_lock<std::mutex> lock(this->mutex);
+	    this->returned.wait(lock, [&]() { return this->take(nbytes, exceed_limit, &allocation); });
+	}
+	return Buffer(allocation.memory, allocation.nbytes, this->shared_from_this());
+    }
+
+    // Like `acquire` but returns false instead of waiting
+    bool try_acquire(size_t nbytes, Buffer *buffer) {
+	Allocation allocation;
+	{
+	    std::lock_guard<std::mutex> lock(this->mutex);
+	    if (!this->take(nbytes, false, &allocation)) {
+		return false;
+	    }
+	}
+	*buffer = Buffer(allocation.memory, allocation.nbytes, this->shared_from_this());
+	return true;
+    }
+
+    // 0 if there is no limit
+    size_t limit() const {
+	return this->limit_nbytes;
+    }
+
+    // Memory of the buffers in use and of the cached free buffers
+    size_t allocated() const {
+	std::lock_guard<std::mutex> lock(this->mutex);
+	return this->allocated_nbytes;
+    }
+
+    // Memory of the cached free buffers
+    size_t cached_size() const {
+	std::lock_guard<std::mutex> lock(this->mutex);
+	return this->cached_nbytes;
+    }
+};
+
+inline void Buffer::reset() {
+    if (this->memory != nullptr) {
+	this->pool->give_back(this->memory, this->capacity);
+    }
+    this->memory = nullptr;
+    this->capacity = 0;
+    this->pool.reset();
+}
+}
+
+#endif
@@ -37,32 +37,1307 @@
 #include <exception>
 #include <thread>
 #include <future>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <cstdint>
+#include <iostream>
+#include <cmath>
+#include <fstream>
+#include <memory>
+#include <functional>
+#include <chrono>
+#include <atomic>
+#include <cstring>
 
+#include "zlib.h"
 #include "libdeflate.h"
 #include "BS_thread_pool.hpp"
 
+#include "tigz_mapped_file.hpp"
+#include "tigz_stats.hpp"
+#include "tigz_buffer_pool.hpp"
+#include "tigz_output_writer.hpp"
+#include "tigz_affinity.hpp"
+#include "tigz_format.hpp"
+
 namespace tigz {
+// Records that blocks are not split inside with `set_record_format`
+enum class RecordFormat { none, lines, fastq };
+
 class ParallelCompressor {
 private:
+    // A block of input that is in flight between the reader,
+    // the compressing threads, and the writer.
+    struct Block {
+	// Memory from the buffer pool while the block is in flight: the
+	// input (unless it is mapped) followed by the output buffer `out`.
+	Buffer memory;
+	char *out = nullptr;
+	size_t out_capacity = 0;
+	size_t in_nbytes = 0;
+	size_t out_nbytes = 0;
+
+	// Points to `memory` or into the mapping of the input file
+	const char *in_data = nullptr;
+	std::shared_ptr<const MappedFile> mapping;
+
+	// Last 32 KiB of the previous block when priming with a dictionary
+	std::basic_string<char> dictionary;
+	size_t dictionary_nbytes = 0;
+
+	// crc32 (gzip) or adler32 (zlib) of `in` when the blocks are
+	// joined into a single stream
+	uint32_t check = 0;
+
+	// Index of the job the block belongs to
+	size_t job = 0;
+
+	// Time spent compressing the block and the thread that did it
+	double process_seconds = 0.0;
+	std::thread::id thread;
+
+	// Newlines in the block, counted if `count_lines` for the record index
+	bool count_lines = false;
+	size_t n_lines = 0;
+
+	std::future<void> compressed;
+    };
+
+    // An input to compress and where to write it. Streams that are
+    // nullptr are opened from the paths when the job is reached; an
+    // empty `out_path` means stdout and an empty `gzi_path` or
+    // `record_index_path` no index.
+    struct Job {
+	std::istream *in = nullptr;
+	std::string in_path;
+	std::ostream *out = nullptr;
+	std::string out_path;
+	std::ostream *gzi_out = nullptr;
+	std::string gzi_path;
+	std::ostream *record_index_out = nullptr;
+	std::string record_index_path;
+    };
+
+    // State of the stream that is pushed in with `write`
+    struct Stream {
+	bool open = false;
+	std::function<void(const char*, size_t)> sink;
+
+	// Blocks submitted to the pool and passed to the sink
+	size_t n_submitted = 0;
+	size_t n_written = 0;
+
+	// Bytes in the block that is being filled and its size
+	size_t fill_nbytes = 0;
+	size_t fill_capacity = 0;
+
+	// Combined check value and length for the single stream trailer
+	uint32_t check = 0;
+	size_t total_in_nbytes = 0;
+
+	// End of the last block for the dictionary of the next one
+	std::basic_string<char> dictionary_tail;
+
+	// Partial record cut from the end of the last block
+	std::basic_string<char> record_carry;
+
+	// For the stats of the stream
+	StatsClock::time_point start;
+	double process_seconds_before = 0.0;
+    };
+
     // Compressor options
     size_t compression_level;
+    Format format = Format::gzip;
+    bool use_dictionary = false;
+    bool bgzf = false;
+    RecordFormat record_format = RecordFormat::none;
 
-    // Buffer settings
+    // Buffer settings. The output buffers are at least `out_buffer_size`.
     size_t in_buffer_size;
     size_t out_buffer_size;
 
-    // Threading
+    // Memory of the blocks in flight, possibly shared with others
+    std::shared_ptr<BufferPool> buffer_pool;
+
+    // Write output files with O_DIRECT
+    bool direct_io = false;
+
+    // Block size chosen at runtime with `set_auto_block_size`. The
+    // threads move it towards the size they compress in about
+    // `target_block_seconds`, within the limits.
+    bool auto_block_size = false;
+    std::atomic<size_t> tuned_block_nbytes;
+    size_t max_tuned_block_nbytes;
+    static constexpr size_t min_tuned_block_nbytes = 65536;
+    static constexpr double target_block_seconds = 0.02;
+
+    // Threading. Worker `i` of the pool runs on `cpus[i % cpus.size()]`
+    // if `cpus` is not empty.
     size_t n_threads;
     BS::thread_pool pool;
+    std::vector<int> cpus;
 
-    // Each thread needs its own buffers and compressor
-    std::vector<std::basic_string<char>> in_buffers;
-    std::vector<std::basic_string<char>> out_buffers;
+    // Index of the pool worker on this thread, set by `start_workers`.
+    // Each compressor has its own pool, so a thread is a worker of one.
+    inline static thread_local size_t current_worker = 0;
+
+    // Ring of blocks in flight. The ring is deeper than the number of
+    // threads so that the reader can fill the next blocks and the
+    // writer can flush finished ones while the threads are compressing.
+    size_t n_blocks;
+    std::vector<Block> blocks;
+
+    // Each worker has its own compressor, allocated by the worker so
+    // that its memory is on the worker's NUMA node
     std::vector<libdeflate_compressor*> compressors;
 
+    // zlib deflate states for the dictionary primed blocks since
+    // libdeflate does not support preset dictionaries, one per worker.
+    // Each worker initializes its own on first use so that the state is
+    // on its NUMA node like the compressors.
+    std::vector<z_stream> deflate_streams;
+    std::vector<char> deflate_stream_ready;
+
+    // zlib inflate states, likewise per worker, that find the bit
+    // offsets of the deflate blocks that libdeflate wrote
+    std::vector<z_stream> inflate_streams;
+    std::vector<char> inflate_stream_ready;
+
+    Stream stream;
+
+    // Timings and counters, if enabled
+    bool collect_stats = false;
+    Stats stats;
+
+    // BGZF blocks hold at most 0xff00 bytes of input so that the
+    // compressed block always fits in 64 KiB.
+    static constexpr size_t bgzf_max_in_nbytes = 65280;
+    static constexpr size_t bgzf_max_block_nbytes = 65536;
+
+    // gzip header with no name or timestamp and OS = unix
+    static constexpr char gzip_header[10] = { '\x1f', '\x8b', '\x08', 0, 0, 0, 0, 0, 0, '\x03' };
+
+    // BGZF end-of-file marker: an empty BGZF block
+    static constexpr char bgzf_eof_block[28] = { '\x1f', '\x8b', '\x08', '\x04', 0, 0, 0, 0, 0, '\xff', '\x06', 0, 'B', 'C', '\x02', 0, '\x1b', 0, '\x03', 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+
+    // Write the `nbytes` lowest bytes of `value` to `dest` in little endian order
+    static void put_le(char *dest, uint64_t value, size_t nbytes) {
+	for (size_t i = 0; i < nbytes; ++i) {
+	    dest[i] = (value >> (8*i)) & 0xff;
+	}
+    }
+
+    // The blocks are joined into a single deflate stream with a
+    // dictionary, and always in the zlib and raw deflate formats since
+    // those can't be concatenated like gzip members.
+    bool single_stream() const {
+	return this->use_dictionary || this->format != Format::gzip;
+    }
+
+    // Write the header of a single stream to `dest` and return its length
+    size_t put_stream_header(char *dest) const {
+	if (this->format == Format::gzip) {
+	    std::copy(gzip_header, gzip_header + 10, dest);
+	    return 10;
+	} else if (this->format == Format::zlib) {
+	    // 32 KiB window, the level in FLEVEL, and FCHECK that makes
+	    // the header a multiple of 31
+	    int flevel = (this->compression_level < 2 ? 0 : (this->compression_level < 6 ? 1 : (this->compression_level == 6 ? 2 : 3)));
+	    unsigned header = (0x78 << 8) | (flevel << 6);
+	    header += 31 - header % 31;
+	    dest[0] = header >> 8;
+	    dest[1] = header & 0xff;
+	    return 2;
+	}
+	return 0;
+    }
+
+    // End of a single stream: a final empty fixed Huffman block, then
+    // crc32 and input size mod 2^32 in little endian order for gzip or
+    // big endian adler32 for zlib. Returns the length of the trailer.
+    size_t put_stream_trailer(char *dest, uint32_t check, size_t total_in_nbytes) const {
+	dest[0] = '\x03';
+	dest[1] = 0;
+	if (this->format == Format::gzip) {
+	    put_le(dest + 2, check, 4);
+	    put_le(dest + 6, total_in_nbytes, 4);
+	    return 10;
+	} else if (this->format == Format::zlib) {
+	    for (size_t i = 0; i < 4; ++i) {
+		dest[2 + i] = (check >> (24 - 8*i)) & 0xff;
+	    }
+	    return 6;
+	}
+	return 2;
+    }
+
+    // Check value of an empty single stream
+    uint32_t initial_check() const {
+	return (this->format == Format::zlib ? 1 : 0);
+    }
+
+    // Check value of the single stream so far followed by a block
+    uint32_t combine_check(uint32_t check, const Block &block) const {
+	if (this->format == Format::zlib) {
+	    return adler32_combine(check, block.check, block.in_nbytes);
+	}
+	return crc32_combine(check, block.check, block.in_nbytes);
+    }
+
+    // Size of `nbytes` of input written as stored deflate blocks
+    static size_t stored_nbytes(size_t nbytes) {
+	return nbytes + 5*std::max((nbytes + 65534)/65535, (size_t)1);
+    }
+
+    // Write `nbytes` from `src` to `dest` as stored (uncompressed)
+    // deflate blocks, marking the last one final if `final_block` is
+    // true. Returns the number of bytes written to `dest`.
+    static size_t deflate_store(const char *src, size_t nbytes, char *dest, bool final_block) {
+	size_t written = 0;
+	do {
+	    size_t len = std::min(nbytes, (size_t)65535);
+	    nbytes -= len;
+	    dest[written] = (final_block && nbytes == 0 ? '\x01' : '\x00');
+	    put_le(dest + written + 1, len, 2);
+	    put_le(dest + written + 3, ~len, 2);
+	    std::copy(src, src + len, dest + written + 5);
+	    src += len;
+	    written += len + 5;
+	} while (nbytes > 0);
+	return written;
+    }
+
+    // Check if `data` looks like it is already compressed or random
+    // from the order-0 entropy of a sample of four 4 KiB windows spread
+    // over the block. Deflate can't shrink such data, so it can be
+    // stored without spending time in the compressor.
+    static bool looks_incompressible(const char *data, size_t nbytes) {
+	constexpr size_t n_windows = 4;
+	constexpr size_t window_nbytes = 4096;
+	if (nbytes < window_nbytes) {
+	    // Too small for a reliable estimate
+	    return false;
+	}
+
+	size_t counts[256] = { 0 };
+	size_t n_sampled = 0;
+	size_t stride = nbytes/n_windows;
+	for (size_t i = 0; i < n_windows; ++i) {
+	    size_t start = std::min(i*stride, nbytes - window_nbytes);
+	    const unsigned char *window = reinterpret_cast<const unsigned char*>(data + start);
+	    for (size_t j = 0; j < window_nbytes; ++j) {
+		++counts[window[j]];
+	    }
+	    n_sampled += window_nbytes;
+	}
+
+	double entropy = 0.0;
+	for (size_t i = 0; i < 256; ++i) {
+	    if (counts[i] > 0) {
+		double p = (double)counts[i]/n_sampled;
+		entropy -= p*std::log2(p);
+	    }
+	}
+	return entropy > 7.9;
+    }
+
+    // Output buffer that fits a block of `in_nbytes` of input. Blocks
+    // that don't compress to less than this are stored instead.
+    size_t out_bound(size_t in_nbytes) const {
+	if (this->bgzf) {
+	    return bgzf_max_block_nbytes;
+	}
+	return std::max(stored_nbytes(in_nbytes) + 18, this->out_buffer_size);
+    }
+
+    // Take the memory of `block` from the pool: room for `in_nbytes` of
+    // input unless it is mapped, then the page aligned output buffer.
+    // If `wait` is false, returns false when the pool is at its limit
+    // instead of waiting; `exceed_limit` is passed to the pool.
+    bool acquire_block_memory(Block &block, size_t in_nbytes, bool mapped, bool wait, bool exceed_limit) {
+	size_t in_part_nbytes = (mapped ? 0 : (in_nbytes + 4095)/4096*4096);
+	size_t nbytes = in_part_nbytes + this->out_bound(in_nbytes);
+	if (wait) {
+	    block.memory = this->buffer_pool->acquire(nbytes, exceed_limit);
+	} else if (!this->buffer_pool->try_acquire(nbytes, &block.memory)) {
+	    return false;
+	}
+	block.out = block.memory.data() + in_part_nbytes;
+	block.out_capacity = block.memory.size() - in_part_nbytes;
+	return true;
+    }
+
+    // Compress `block` into a gzip member, or store it if `store` is true
+    // or if it did not fit in the output buffer.
+    void gzip_compress_block(Block &block, libdeflate_compressor *compressor, bool store) {
+	block.out_nbytes = 0;
+	if (!store) {
+	    block.out_nbytes = libdeflate_gzip_compress(compressor,
+							block.in_data,
+							block.in_nbytes,
+							block.out,
+							block.out_capacity);
+	}
+	if (block.out_nbytes == 0) {
+	    // Didn't fit in the output buffer or was not compressed
+	    char *member = block.out;
+	    std::copy(gzip_header, gzip_header + 10, member);
+	    size_t payload_nbytes = deflate_store(block.in_data, block.in_nbytes, member + 10, true);
+	    put_le(member + 10 + payload_nbytes, libdeflate_crc32(0, block.in_data, block.in_nbytes), 4);
+	    put_le(member + 14 + payload_nbytes, block.in_nbytes, 4);
+	    block.out_nbytes = payload_nbytes + 18;
+	}
+    }
+
+    // Compress `block` into a BGZF block: a gzip member with the BC
+    // extra field that stores the total size of the block. The block is
+    // stored if `store` is true or if it did not fit in 64 KiB.
+    void bgzf_compress_block(Block &block, libdeflate_compressor *compressor, bool store) {
+	if (block.in_nbytes == 0) {
+	    // Empty inputs are only the EOF marker block
+	    block.out_nbytes = 0;
+	    return;
+	}
+
+	char *header = block.out;
+	char *payload = header + 18;
+	size_t max_payload_nbytes = bgzf_max_block_nbytes - 26;
+
+	size_t payload_nbytes = 0;
+	if (!store) {
+	    payload_nbytes = libdeflate_deflate_compress(compressor,
+							 block.in_data,
+							 block.in_nbytes,
+							 payload,
+							 max_payload_nbytes);
+	}
+	if (payload_nbytes == 0) {
+	    // Fits in a single stored deflate block
+	    payload_nbytes = deflate_store(block.in_data, block.in_nbytes, payload, true);
+	}
+	size_t block_nbytes = payload_nbytes + 26;
+
+	const char bgzf_header[16] = { '\x1f', '\x8b', '\x08', '\x04', 0, 0, 0, 0, 0, '\xff', '\x06', 0, 'B', 'C', '\x02', 0 };
+	std::copy(bgzf_header, bgzf_header + 16, header);
+	put_le(header + 16, block_nbytes - 1, 2);
+
+	uint32_t crc = libdeflate_crc32(0, block.in_data, block.in_nbytes);
+	put_le(payload + payload_nbytes, crc, 4);
+	put_le(payload + payload_nbytes + 4, block.in_nbytes, 4);
+	block.out_nbytes = block_nbytes;
+    }
+
+    // crc32 (gzip) or adler32 (zlib) of the input of a block that is
+    // joined into a single stream
+    void set_block_check(Block &block) const {
+	if (this->format == Format::gzip) {
+	    block.check = crc32(0, reinterpret_cast<const Bytef*>(block.in_data), block.in_nbytes);
+	} else if (this->format == Format::zlib) {
+	    block.check = adler32(1, reinterpret_cast<const Bytef*>(block.in_data), block.in_nbytes);
+	}
+    }
+
+    // Compress `block` into a raw deflate stream that is primed with
+    // `block.dictionary` and ends at a byte aligned sync flush point.
+    // If `store` is true the block is written as stored deflate blocks,
+    // which are byte aligned and don't need the dictionary.
+    void deflate_block(Block &block, z_stream *strm, bool store) {
+	this->set_block_check(block);
+	if (store) {
+	    block.out_nbytes = deflate_store(block.in_data, block.in_nbytes, block.out, false);
+	    return;
+	}
+
+	if (deflateReset(strm) != Z_OK) {
+	    throw std::runtime_error("resetting the deflate stream failed.");
+	}
+	if (block.dictionary_nbytes > 0) {
+	    deflateSetDictionary(strm, reinterpret_cast<const Bytef*>(block.dictionary.data()), block.dictionary_nbytes);
+	}
+
+	strm->next_in = reinterpret_cast<Bytef*>(const_cast<char*>(block.in_data));
+	strm->avail_in = block.in_nbytes;
+	strm->next_out = reinterpret_cast<Bytef*>(block.out);
+	strm->avail_out = block.out_capacity;
+	if (deflate(strm, Z_SYNC_FLUSH) == Z_STREAM_ERROR) {
+	    throw std::runtime_error("deflating a block failed.");
+	}
+	if (strm->avail_in > 0 || strm->avail_out == 0) {
+	    // Did not fit in the output buffer (or the flush may not have)
+	    block.out_nbytes = deflate_store(block.in_data, block.in_nbytes, block.out, false);
+	    return;
+	}
+	block.out_nbytes = block.out_capacity - strm->avail_out;
+    }
+
+    // Compress `block` with libdeflate into raw deflate that can be
+    // joined with the next block like `deflate_block` output. libdeflate
+    // ends its output with a final block and can't sync flush, so
+    // `strm` decodes the output to find the bit offsets of the last
+    // block and of the end. The final bit of the last block is cleared
+    // and an empty stored block is appended at the end, which is what a
+    // sync flush writes.
+    void join_compress_block(Block &block, libdeflate_compressor *compressor, z_stream *strm, bool store) {
+	this->set_block_check(block);
+	block.out_nbytes = 0;
+	if (block.in_nbytes == 0) {
+	    return;
+	}
+	if (!store && block.out_capacity > 5) {
+	    // Room for the empty stored block
+	    block.out_nbytes = libdeflate_deflate_compress(compressor, block.in_data, block.in_nbytes, block.out, block.out_capacity - 5);
+	}
+	if (block.out_nbytes == 0) {
+	    block.out_nbytes = deflate_store(block.in_data, block.in_nbytes, block.out, false);
+	    return;
+	}
+
+	if (inflateReset(strm) != Z_OK) {
+	    throw std::runtime_error("resetting the inflate stream failed.");
+	}
+	unsigned char window[32768];
+	strm->next_in = reinterpret_cast<Bytef*>(block.out);
+	strm->avail_in = block.out_nbytes;
+	// inflate stops after each block. The last block starts where the
+	// one before it ended, and the output ends where the last one does.
+	size_t last_block_bit = 0;
+	size_t end_bit = 0;
+	int ret = Z_OK;
+	while (ret == Z_OK) {
+	    strm->next_out = window;
+	    strm->avail_out = sizeof(window);
+	    ret = inflate(strm, Z_BLOCK);
+	    if (ret == Z_OK && (strm->data_type & 128)) {
+		size_t bit = 8*(block.out_nbytes - strm->avail_in) - (strm->data_type & 7);
+		if (strm->data_type & 64) {
+		    end_bit = bit;
+		} else {
+		    last_block_bit = bit;
+		}
+	    }
+	}
+	if (ret != Z_STREAM_END || end_bit == 0) {
+	    throw std::runtime_error("finding the deflate blocks of a compressed block failed.");
+	}
+
+	unsigned char *out = reinterpret_cast<unsigned char*>(block.out);
+	out[last_block_bit/8] &= ~(1 << (last_block_bit % 8));
+	// The stored block header (not final, type 00) and the padding to
+	// the next byte are zero bits after the end, then LEN and NLEN
+	size_t header_nbytes = (end_bit + 3 + 7)/8;
+	if (end_bit % 8 != 0) {
+	    out[end_bit/8] &= (1 << (end_bit % 8)) - 1;
+	}
+	std::fill(out + (end_bit + 7)/8, out + header_nbytes, 0);
+	const unsigned char empty_stored[4] = { 0x00, 0x00, 0xff, 0xff };
+	std::copy(empty_stored, empty_stored + 4, out + header_nbytes);
+	block.out_nbytes = header_nbytes + 4;
+    }
+
+    // Length of the start of `data` up to and including the last
+    // newline, or 0 if there is none. glibc's memrchr is vectorized.
+    static size_t last_line_end(const char *data, size_t nbytes) {
+	const void *newline = (nbytes > 0 ? memrchr(data, '\n', nbytes) : nullptr);
+	return (newline == nullptr ? 0 : static_cast<const char*>(newline) - data + 1);
+    }
+
+    // Length of the start of `data` up to the end of the last complete
+    // FASTQ record, or 0 if there is none in the last 16 lines. The four
+    // lines before a record end are a record if the first starts with
+    // '@' and the third with '+'; a quality line that starts with '@' is
+    // never followed by a '+' two lines later. `data` starts a record.
+    static size_t last_fastq_record_end(const char *data, size_t nbytes) {
+	// Starts of the last five lines from the back, 0 for the start of `data`
+	size_t line_starts[5];
+	size_t n_found = 0;
+	size_t search_nbytes = nbytes;
+	for (size_t i = 0; i < 16; ++i) {
+	    size_t line_start = last_line_end(data, search_nbytes);
+	    if (n_found == 5) {
+		std::copy(line_starts + 1, line_starts + 5, line_starts);
+		n_found = 4;
+	    }
+	    line_starts[n_found++] = line_start;
+	    if (n_found == 5 && line_starts[4] < nbytes && line_starts[2] < nbytes &&
+		data[line_starts[4]] == '@' && data[line_starts[2]] == '+') {
+		return line_starts[0];
+	    }
+	    if (line_start == 0) {
+		break;
+	    }
+	    search_nbytes = line_start - 1;
+	}
+	return 0;
+    }
+
+    // Bytes of the full block `data` up to its last record boundary.
+    // Blocks without a boundary, e.g. a single long line, are not split.
+    size_t record_split_nbytes(const char *data, size_t nbytes) const {
+	size_t split_nbytes = (this->record_format == RecordFormat::fastq ? last_fastq_record_end(data, nbytes)
+									    : last_line_end(data, nbytes));
+	return (split_nbytes > 0 ? split_nbytes : nbytes);
+    }
+
+    // Lines in a record for the record index
+    size_t lines_per_record() const {
+	return (this->record_format == RecordFormat::fastq ? 4 : 1);
+    }
+
+    // Index of the pool worker that calls this
+    size_t worker_index() const {
+	return current_worker;
+    }
+
+    // The raw inflate state of the pool worker that calls this,
+    // initialized on the worker the first time
+    z_stream* worker_inflate_stream() {
+	size_t worker = this->worker_index();
+	z_stream &strm = this->inflate_streams[worker];
+	if (!this->inflate_stream_ready[worker]) {
+	    strm.zalloc = Z_NULL;
+	    strm.zfree = Z_NULL;
+	    strm.opaque = Z_NULL;
+	    strm.next_in = Z_NULL;
+	    strm.avail_in = 0;
+	    if (inflateInit2(&strm, -15) != Z_OK) {
+		throw std::runtime_error("initializing the inflate stream failed.");
+	    }
+	    this->inflate_stream_ready[worker] = 1;
+	}
+	return &strm;
+    }
+
+    // The deflate state of the pool worker that calls this, initialized
+    // on the worker the first time
+    z_stream* worker_deflate_stream() {
+	size_t worker = this->worker_index();
+	z_stream &strm = this->deflate_streams[worker];
+	if (!this->deflate_stream_ready[worker]) {
+	    strm.zalloc = Z_NULL;
+	    strm.zfree = Z_NULL;
+	    strm.opaque = Z_NULL;
+	    int level = std::min(this->compression_level, (size_t)9);
+	    if (deflateInit2(&strm, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		throw std::runtime_error("initializing the deflate stream failed.");
+	    }
+	    this->deflate_stream_ready[worker] = 1;
+	}
+	return &strm;
+    }
+
+    // Run one task on every worker at the same time so that each worker
+    // pins itself to its CPU and then allocates its own compressor.
+    void start_workers() {
+	this->pool.wait_for_tasks();
+	for (libdeflate_compressor *compressor : this->compressors) {
+	    libdeflate_free_compressor(compressor);
+	}
+	this->compressors.assign(this->n_threads, nullptr);
+	// New workers initialize their deflate states again
+	this->free_deflate_streams();
+
+	std::mutex started_mutex;
+	std::condition_variable all_started;
+	size_t n_started = 0;
+	std::exception_ptr pin_error = nullptr;
+	for (size_t i = 0; i < this->n_threads; ++i) {
+	    this->pool.push_task([&, i]() {
+		{
+		    std::unique_lock<std::mutex> lock(started_mutex);
+		    ++n_started;
+		    all_started.notify_all();
+		    all_started.wait(lock, [&]() { return n_started == this->n_threads; });
+		}
+		try {
+		    if (!this->cpus.empty()) {
+			set_thread_cpus({ this->cpus[i % this->cpus.size()] });
+		    }
+		} catch (...) {
+		    std::lock_guard<std::mutex> lock(started_mutex);
+		    pin_error = std::current_exception();
+		}
+		// The worker needs a compressor even if it could not be pinned
+		current_worker = i;
+		this->compressors[i] = libdeflate_alloc_compressor(this->compression_level);
+	    });
+	}
+	this->pool.wait_for_tasks();
+	if (pin_error) {
+	    std::rethrow_exception(pin_error);
+	}
+    }
+
+    void compress_block(size_t slot) {
+	Block &block = this->blocks[slot];
+	if (block.count_lines) {
+	    block.n_lines = std::count(block.in_data, block.in_data + block.in_nbytes, '\n');
+	}
+	bool timed = (this->collect_stats || this->auto_block_size);
+	StatsClock::time_point start = (timed ? StatsClock::now() : StatsClock::time_point());
+	bool store = looks_incompressible(block.in_data, block.in_nbytes);
+	if (this->use_dictionary) {
+	    this->deflate_block(block, this->worker_deflate_stream(), store);
+	} else if (this->single_stream()) {
+	    this->join_compress_block(block, this->compressors[this->worker_index()], this->worker_inflate_stream(), store);
+	} else if (this->bgzf) {
+	    this->bgzf_compress_block(block, this->compressors[this->worker_index()], store);
+	} else {
+	    this->gzip_compress_block(block, this->compressors[this->worker_index()], store);
+	}
+	if (timed) {
+	    block.process_seconds = seconds_since(start);
+	    block.thread = std::this_thread::get_id();
+	}
+	if (this->auto_block_size) {
+	    this->tune_block_size(block);
+	}
+    }
+
+    // Move the block size a quarter of the way towards the size that
+    // compresses in `target_block_seconds` at the rate measured for
+    // `block`. Races between the threads only lose an update.
+    void tune_block_size(const Block &block) {
+	if (block.in_nbytes < min_tuned_block_nbytes/2 || block.process_seconds <= 0.0) {
+	    // Too little data for a reliable rate
+	    return;
+	}
+	double target_nbytes = block.in_nbytes/block.process_seconds*target_block_seconds;
+	double nbytes = 0.75*this->tuned_block_nbytes.load(std::memory_order_relaxed) + 0.25*std::min(target_nbytes, 1e12);
+
+	// Round to 64 KiB
+	size_t tuned_nbytes = ((size_t)nbytes + 32768)/65536*65536;
+	tuned_nbytes = std::min(std::max(tuned_nbytes, min_tuned_block_nbytes), this->max_tuned_block_nbytes);
+	this->tuned_block_nbytes.store(tuned_nbytes, std::memory_order_relaxed);
+    }
+
+    // Current time if stats are collected
+    StatsClock::time_point stats_now() const {
+	return (this->collect_stats ? StatsClock::now() : StatsClock::time_point());
+    }
+
+    // Count a block that was written to the output
+    void record_block(const Block &block) {
+	this->stats.in_nbytes += block.in_nbytes;
+	this->stats.out_nbytes += block.out_nbytes;
+	this->stats.add_block(block.in_nbytes, block.out_nbytes);
+	this->stats.add_process_seconds(block.thread, block.process_seconds);
+    }
+
+    // Add the wall time of a run that started at `start`. The threads
+    // were idle for the part of it that they did not spend compressing.
+    void record_run(const StatsClock::time_point &start, double process_seconds_before) {
+	double wall_seconds = seconds_since(start);
+	double run_process_seconds = this->stats.process_seconds - process_seconds_before;
+	this->stats.n_threads = this->n_threads;
+	this->stats.wall_seconds += wall_seconds;
+	this->stats.idle_seconds += std::max(this->n_threads*wall_seconds - run_process_seconds, 0.0);
+    }
+
+    // Bytes of input in a full block. With auto block size and a memory
+    // limit, the blocks are kept small enough that the ring fits twice.
+    size_t block_capacity() const {
+	size_t nbytes = this->in_buffer_size;
+	if (this->auto_block_size) {
+	    nbytes = this->tuned_block_nbytes.load(std::memory_order_relaxed);
+	    if (this->buffer_pool->limit() > 0) {
+		nbytes = std::min(nbytes, std::max(this->buffer_pool->limit()/(4*this->n_blocks), min_tuned_block_nbytes));
+	    }
+	}
+	return (this->bgzf ? std::min(nbytes, bgzf_max_in_nbytes) : nbytes);
+    }
+
+    // Bytes of input in a full block of an input that is `input_nbytes`
+    // long, or of unknown length if 0. With auto block size the blocks
+    // of small inputs are made smaller so that each thread gets a few.
+    size_t block_capacity(size_t input_nbytes) const {
+	size_t nbytes = this->block_capacity();
+	if (this->auto_block_size && input_nbytes > 0) {
+	    nbytes = std::min(nbytes, std::max(input_nbytes/(4*this->n_threads), min_tuned_block_nbytes));
+	}
+	return nbytes;
+    }
+
+    // Bytes of input in a block that starts with `carry_nbytes` of a
+    // record cut from the previous block: room for at least as much new
+    // input, but never more than a BGZF block holds. The carry is always
+    // shorter than the block it was cut from, so new input still fits.
+    size_t carry_block_capacity(size_t nbytes, size_t carry_nbytes) const {
+	nbytes = std::max(nbytes, 2*carry_nbytes);
+	return (this->bgzf ? std::min(nbytes, bgzf_max_in_nbytes) : nbytes);
+    }
+
+    // Prime `block` with `tail`, the last 32 KiB of the previous block,
+    // and keep the end of `block` in `tail` for the next one. The tail is
+    // copied since the previous block's memory may be back in the pool.
+    static void pass_dictionary(Block &block, std::basic_string<char> &tail, bool first_block) {
+	block.dictionary_nbytes = 0;
+	if (!first_block) {
+	    block.dictionary_nbytes = tail.size();
+	    std::copy(tail.begin(), tail.end(), block.dictionary.data());
+	}
+	size_t tail_nbytes = std::min(block.in_nbytes, block.dictionary.size());
+	tail.assign(block.in_data + block.in_nbytes - tail_nbytes, tail_nbytes);
+    }
+
+    // Wait for the oldest block of the pushed stream and pass it to the sink
+    void stream_write_oldest() {
+	Block &block = this->blocks[this->stream.n_written % this->n_blocks];
+	StatsClock::time_point start = this->stats_now();
+	block.compressed.get();
+	if (this->collect_stats) {
+	    this->stats.write_wait_seconds += seconds_since(start);
+	    start = StatsClock::now();
+	}
+	if (block.out_nbytes > 0) {
+	    this->stream.sink(block.out, block.out_nbytes);
+	}
+	block.memory = Buffer();
+	if (this->collect_stats) {
+	    this->stats.write_seconds += seconds_since(start);
+	    this->record_block(block);
+	}
+	if (this->single_stream()) {
+	    this->stream.check = this->combine_check(this->stream.check, block);
+	    this->stream.total_in_nbytes += block.in_nbytes;
+	}
+	++this->stream.n_written;
+    }
+
+    // Take the memory of the next block of the pushed stream. While the
+    // pool is at its limit the oldest blocks are passed to the sink.
+    void stream_acquire_memory(Block &block, size_t in_nbytes) {
+	while (!this->acquire_block_memory(block, in_nbytes, false, false, false)) {
+	    if (this->stream.n_written == this->stream.n_submitted) {
+		// None of the memory in use is ours to free
+		this->acquire_block_memory(block, in_nbytes, false, true, true);
+		break;
+	    }
+	    this->stream_write_oldest();
+	}
+    }
+
+    // Start filling the next block of the ring with the partial record
+    // that was cut from the end of the last one
+    void stream_start_block() {
+	while (this->stream.n_submitted - this->stream.n_written == this->n_blocks) {
+	    this->stream_write_oldest();
+	}
+	Block &block = this->blocks[this->stream.n_submitted % this->n_blocks];
+	const std::basic_string<char> &carry = this->stream.record_carry;
+	this->stream.fill_capacity = this->carry_block_capacity(this->block_capacity(), carry.size());
+	this->stream_acquire_memory(block, this->stream.fill_capacity);
+	std::copy(carry.begin(), carry.end(), block.memory.data());
+	this->stream.fill_nbytes = carry.size();
+	this->stream.record_carry.clear();
+    }
+
+    // Submit the block that is being filled, then pass the finished
+    // blocks at the front of the ring to the sink without waiting. Full
+    // blocks are cut at their last record boundary if `split_records`.
+    void stream_submit(bool split_records) {
+	size_t slot = this->stream.n_submitted % this->n_blocks;
+	Block &block = this->blocks[slot];
+	if (block.memory.data() == nullptr) {
+	    // The empty block of an empty stream
+	    this->stream_acquire_memory(block, 0);
+	}
+	block.mapping.reset();
+	block.in_data = block.memory.data();
+	block.in_nbytes = this->stream.fill_nbytes;
+	if (split_records && this->record_format != RecordFormat::none) {
+	    size_t split_nbytes = this->record_split_nbytes(block.in_data, block.in_nbytes);
+	    this->stream.record_carry.assign(block.in_data + split_nbytes, block.in_nbytes - split_nbytes);
+	    block.in_nbytes = split_nbytes;
+	}
+	if (this->use_dictionary) {
+	    pass_dictionary(block, this->stream.dictionary_tail, this->stream.n_submitted == 0);
+	}
+	block.compressed = this->pool.submit([this, slot]() { this->compress_block(slot); });
+	++this->stream.n_submitted;
+	this->stream.fill_nbytes = 0;
+
+	while (this->stream.n_written < this->stream.n_submitted &&
+	       this->blocks[this->stream.n_written % this->n_blocks].compressed.wait_for(std::chrono::seconds(0)) == std::future_status::ready) {
+	    this->stream_write_oldest();
+	}
+    }
+
+    // Drop the pushed stream after an error
+    void abort_stream() {
+	// Blocks still in the pool reference the ring buffers
+	this->pool.wait_for_tasks();
+	for (size_t i = 0; i < this->n_blocks; ++i) {
+	    this->blocks[i].memory = Buffer();
+	}
+	this->stream = Stream();
+    }
+
+    // Throw if the options can't be used together
+    void check_options() const {
+	if (this->use_dictionary && this->bgzf) {
+	    throw std::invalid_argument("dictionary priming can't be used with BGZF output.");
+	}
+	if (this->use_dictionary && this->record_format != RecordFormat::none) {
+	    throw std::invalid_argument("record splitting can't be used with dictionary priming.");
+	}
+	if (this->format != Format::gzip && this->bgzf) {
+	    throw std::invalid_argument("BGZF output is always gzip.");
+	}
+	if (this->format != Format::gzip && this->record_format != RecordFormat::none) {
+	    throw std::invalid_argument("record splitting needs gzip members, it can't be used with zlib or deflate output.");
+	}
+	if (this->format != Format::gzip && this->use_dictionary && this->compression_level > 9) {
+	    throw std::invalid_argument("dictionary priming uses zlib, which only has levels 0..9.");
+	}
+    }
+
+    // Set up the dictionaries if the blocks are primed. The deflate
+    // states are initialized by the workers when they are first used.
+    void init_dictionaries() {
+	for (size_t i = 0; i < this->n_blocks; ++i) {
+	    this->blocks[i].dictionary.resize(this->use_dictionary ? 32768 : 0);
+	    this->blocks[i].dictionary_nbytes = 0;
+	}
+    }
+
+    void free_deflate_streams() {
+	for (size_t i = 0; i < this->deflate_streams.size(); ++i) {
+	    if (this->deflate_stream_ready[i]) {
+		(void)deflateEnd(&this->deflate_streams[i]);
+	    }
+	}
+	for (size_t i = 0; i < this->inflate_streams.size(); ++i) {
+	    if (this->inflate_stream_ready[i]) {
+		(void)inflateEnd(&this->inflate_streams[i]);
+	    }
+	}
+	this->deflate_streams = std::vector<z_stream>(this->n_threads);
+	this->deflate_stream_ready.assign(this->n_threads, 0);
+	this->inflate_streams = std::vector<z_stream>(this->n_threads);
+	this->inflate_stream_ready.assign(this->n_threads, 0);
+    }
+
+    // Compress the jobs through the same ring of blocks. The calling
+    // thread reads the inputs one after another into the ring and
+    // submits the blocks to the pool, while a dedicated writer thread
+    // waits on the blocks in the order they were read and writes each to
+    // its job's output as soon as it is done. Since the ring is shared,
+    // the threads stay busy across the boundaries of small inputs.
+    void compress_jobs(const std::vector<Job> &jobs) {
+	this->check_options();
+	if (this->stream.open) {
+	    throw std::logic_error("can't compress other inputs while a stream is open.");
+	}
+	StatsClock::time_point start = this->stats_now();
+	double process_seconds_before = this->stats.process_seconds;
+
+	std::mutex ring_mutex;
+	std::condition_variable block_submitted;
+	std::condition_variable block_written;
+	size_t n_submitted = 0;
+	size_t n_written = 0;
+	bool reading_done = false;
+	std::exception_ptr writer_error = nullptr;
+
+	// End of the last block read for the dictionary of the next one
+	std::basic_string<char> dictionary_tail;
+
+	std::thread writer([&]() {
+	    // Output of the current job. Files and stdout are written by
+	    // `out_writer` in batches of blocks, other streams through `out`.
+	    size_t job = 0;
+	    std::ostream *out = nullptr;
+	    std::ostream *gzi_out = nullptr;
+	    std::ostream *record_index_out = nullptr;
+	    std::unique_ptr<OutputWriter> out_writer;
+	    std::unique_ptr<std::ofstream> gzi_file;
+	    std::unique_ptr<std::ofstream> record_index_file;
+
+	    // Blocks taken from the ring, and the batch of them that is
+	    // still being written and can't be reused yet
+	    size_t n_taken = 0;
+	    std::vector<size_t> in_flight;
+	    std::vector<iovec> batch;
+	    const size_t max_batch = std::min(this->n_blocks, (size_t)IOV_MAX);
+
+	    // Combined check value and length for the single stream trailer
+	    uint32_t check = 0;
+	    size_t total_in_nbytes = 0;
+
+	    // Offsets of the current block for the .gzi index
+	    uint64_t compressed_offset = 0;
+	    uint64_t uncompressed_offset = 0;
+	    uint64_t n_index_entries = 0;
+
+	    // Lines before the current block for the record index, and if
+	    // the last of them did not end in a newline
+	    uint64_t n_lines = 0;
+	    bool partial_line = false;
+	    uint64_t n_record_index_entries = 0;
+
+	    const auto write_out = [&](const char *data, size_t nbytes) {
+		if (out_writer != nullptr) {
+		    out_writer->write(data, nbytes);
+		} else {
+		    out->write(data, nbytes);
+		}
+	    };
+
+	    // Wait for the batch in flight and give its blocks back to the reader
+	    const auto release_in_flight = [&]() {
+		if (in_flight.empty()) {
+		    return;
+		}
+		if (out_writer != nullptr) {
+		    out_writer->wait();
+		}
+		for (size_t i : in_flight) {
+		    this->blocks[i].memory = Buffer();
+		}
+		{
+		    std::lock_guard<std::mutex> lock(ring_mutex);
+		    n_written += in_flight.size();
+		}
+		in_flight.clear();
+		block_written.notify_one();
+	    };
+
+	    const auto start_job = [&](size_t next_job) {
+		job = next_job;
+		out = jobs[job].out;
+		if (out == nullptr || out == &std::cout) {
+		    // Anything buffered in std::cout goes out first
+		    std::cout.flush();
+		    try {
+			out_writer.reset(new OutputWriter(out == nullptr ? jobs[job].out_path : "", this->direct_io));
+		    } catch (const std::system_error &) {
+			throw std::runtime_error("can't open the output of " + jobs[job].in_path + " for writing.");
+		    }
+		}
+		gzi_out = (this->bgzf ? jobs[job].gzi_out : nullptr);
+		if (this->bgzf && gzi_out == nullptr && !jobs[job].gzi_path.empty()) {
+		    gzi_file.reset(new std::ofstream(jobs[job].gzi_path, std::ios::binary));
+		    gzi_out = gzi_file.get();
+		}
+		record_index_out = (this->record_format != RecordFormat::none ? jobs[job].record_index_out : nullptr);
+		if (this->record_format != RecordFormat::none && record_index_out == nullptr && !jobs[job].record_index_path.empty()) {
+		    record_index_file.reset(new std::ofstream(jobs[job].record_index_path, std::ios::binary));
+		    record_index_out = record_index_file.get();
+		}
+		if ((out_writer == nullptr && out->fail()) || (gzi_out != nullptr && gzi_out->fail()) || (record_index_out != nullptr && record_index_out->fail())) {
+		    throw std::runtime_error("can't open the output of " + jobs[job].in_path + " for writing.");
+		}
+
+		check = this->initial_check();
+		total_in_nbytes = 0;
+		compressed_offset = 0;
+		uncompressed_offset = 0;
+		n_index_entries = 0;
+		n_lines = 0;
+		partial_line = false;
+		n_record_index_entries = 0;
+
+		if (this->single_stream()) {
+		    char header[10];
+		    write_out(header, this->put_stream_header(header));
+		}
+		if (this->bgzf && gzi_out != nullptr) {
+		    // Placeholder for the number of entries
+		    const char zeros[8] = { 0 };
+		    gzi_out->write(zeros, 8);
+		}
+		if (record_index_out != nullptr) {
+		    const char zeros[8] = { 0 };
+		    record_index_out->write(zeros, 8);
+		}
+	    };
+
+	    // Index of the records that start in each member: its offset
+	    // and the number of the first record that starts in it
+	    const auto put_record_index_entry = [&]() {
+		uint64_t started_lines = n_lines + (partial_line ? 1 : 0);
+		char entry[16];
+		put_le(entry, compressed_offset, 8);
+		put_le(entry + 8, (started_lines + this->lines_per_record() - 1)/this->lines_per_record(), 8);
+		record_index_out->write(entry, 16);
+	    };
+
+	    const auto finish_job = [&]() {
+		release_in_flight();
+		if (record_index_out != nullptr) {
+		    // The entry count is followed by the entries and then the
+		    // end of the compressed data and the total record count.
+		    put_record_index_entry();
+		    char count[8];
+		    put_le(count, n_record_index_entries, 8);
+		    record_index_out->seekp(0);
+		    record_index_out->write(count, 8);
+		    record_index_out->seekp(0, std::ios_base::end);
+		}
+
+		if (this->single_stream()) {
+		    char trailer[10];
+		    write_out(trailer, this->put_stream_trailer(trailer, check, total_in_nbytes));
+		}
+
+		if (this->bgzf) {
+		    write_out(bgzf_eof_block, 28);
+		    if (gzi_out != nullptr) {
+			char count[8];
+			put_le(count, n_index_entries, 8);
+			gzi_out->seekp(0);
+			gzi_out->write(count, 8);
+			gzi_out->seekp(0, std::ios_base::end);
+		    }
+		}
+
+		if (out_writer != nullptr) {
+		    out_writer->close();
+		    out_writer.reset();
+		} else {
+		    out->flush();
+		}
+		gzi_file.reset();
+		record_index_file.reset();
+	    };
+
+	    try {
+		bool job_started = false;
+		while (true) {
+		    size_t n_available;
+		    {
+			std::unique_lock<std::mutex> lock(ring_mutex);
+			if (n_taken == n_submitted && !reading_done) {
+			    // The reader may be waiting for the blocks in flight
+			    lock.unlock();
+			    release_in_flight();
+			    lock.lock();
+			}
+			block_submitted.wait(lock, [&]() { return n_taken < n_submitted || reading_done; });
+			if (n_taken == n_submitted) {
+			    break;
+			}
+			n_available = n_submitted - n_taken;
+		    }
+
+		    Block &block = this->blocks[n_taken % this->n_blocks];
+		    if (!job_started || block.job != job) {
+			// Each job has at least one block
+			if (job_started) {
+			    finish_job();
+			}
+			start_job(block.job);
+			job_started = true;
+		    }
+
+		    // Wait for the next block, then take the ones after it
+		    // that are already done into the same batch
+		    StatsClock::time_point wait_start = this->stats_now();
+		    block.compressed.get();
+		    size_t n_batch = 1;
+		    while (n_batch < n_available && n_batch < max_batch) {
+			Block &next = this->blocks[(n_taken + n_batch) % this->n_blocks];
+			if (next.job != job || next.compressed.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+			    break;
+			}
+			next.compressed.get();
+			++n_batch;
+		    }
+		    StatsClock::time_point write_start = this->stats_now();
+
+		    release_in_flight();
+		    batch.clear();
+		    for (size_t i = 0; i < n_batch; ++i) {
+			size_t index = (n_taken + i) % this->n_blocks;
+			Block &batch_block = this->blocks[index];
+			if (out_writer != nullptr) {
+			    batch.push_back(iovec{ batch_block.out, batch_block.out_nbytes });
+			} else {
+			    out->write(batch_block.out, batch_block.out_nbytes);
+			}
+			in_flight.push_back(index);
+
+			if (this->collect_stats) {
+			    this->record_block(batch_block);
+			}
+			if (this->single_stream()) {
+			    check = this->combine_check(check, batch_block);
+			    total_in_nbytes += batch_block.in_nbytes;
+			}
+			if (this->bgzf && gzi_out != nullptr && compressed_offset > 0) {
+			    // The index has the offsets of all but the first block
+			    char entry[16];
+			    put_le(entry, compressed_offset, 8);
+			    put_le(entry + 8, uncompressed_offset, 8);
+			    gzi_out->write(entry, 16);
+			    ++n_index_entries;
+			}
+			if (record_index_out != nullptr && batch_block.out_nbytes > 0) {
+			    put_record_index_entry();
+			    ++n_record_index_entries;
+			}
+			if (record_index_out != nullptr && batch_block.in_nbytes > 0) {
+			    n_lines += batch_block.n_lines;
+			    partial_line = (batch_block.in_data[batch_block.in_nbytes - 1] != '\n');
+			}
+			compressed_offset += batch_block.out_nbytes;
+			uncompressed_offset += batch_block.in_nbytes;
+		    }
+		    if (out_writer != nullptr) {
+			out_writer->submit(batch.data(), batch.size());
+		    }
+		    n_taken += n_batch;
+		    if (this->collect_stats) {
+			this->stats.write_wait_seconds += std::chrono::duration<double>(write_start - wait_start).count();
+			this->stats.write_seconds += seconds_since(write_start);
+		    }
+		}
+		if (job_started) {
+		    finish_job();
+		}
+	    } catch (...) {
+		{
+		    std::lock_guard<std::mutex> lock(ring_mutex);
+		    writer_error = std::current_exception();
+		}
+		block_written.notify_one();
+	    }
+	});
+
+	std::exception_ptr reader_error = nullptr;
+	try {
+	    bool writer_failed = false;
+	    for (size_t job = 0; job < jobs.size() && !writer_failed; ++job) {
+		// Regular files are mapped to memory and compressed directly
+		// from the mapping, other inputs are read through a stream.
+		std::istream *in = jobs[job].in;
+		std::ifstream in_file;
+		std::shared_ptr<const MappedFile> mapping;
+		size_t mapped_offset = 0;
+		if (in == nullptr) {
+		    mapping = MappedFile::map(jobs[job].in_path);
+		    if (mapping == nullptr) {
+			in_file.open(jobs[job].in_path, std::ios::binary);
+			if (in_file.fail()) {
+			    throw std::runtime_error("can't open " + jobs[job].in_path + " for reading.");
+			}
+			in = &in_file;
+		    }
+		}
+
+		// Partial record cut from the end of the last block of a stream
+		std::basic_string<char> record_carry;
+		bool split_records = (this->record_format != RecordFormat::none);
+		bool count_lines = (split_records && (jobs[job].record_index_out != nullptr || !jobs[job].record_index_path.empty()));
+
+		size_t job_n_submitted = 0;
+		bool job_done = (in != nullptr && !in->good());
+		while (!job_done) {
+		    size_t next_block;
+		    bool ring_empty;
+		    StatsClock::time_point wait_start = this->stats_now();
+		    {
+			// Wait until the writer has freed a block in the ring
+			std::unique_lock<std::mutex> lock(ring_mutex);
+			block_written.wait(lock, [&]() { return n_submitted - n_written < this->n_blocks || writer_error; });
+			if (writer_error) {
+			    writer_failed = true;
+			    break;
+			}
+			next_block = n_submitted % this->n_blocks;
+			ring_empty = (n_submitted == n_written);
+		    }
+
+		    // Then for its memory, which the writer returns to the
+		    // pool. Only a shared pool can be full with nothing of
+		    // ours in flight, and then we go over the limit instead.
+		    Block &block = this->blocks[next_block];
+		    size_t read_nbytes = this->carry_block_capacity(this->block_capacity(mapping != nullptr ? mapping->nbytes : 0), record_carry.size());
+		    this->acquire_block_memory(block, read_nbytes, mapping != nullptr, true, ring_empty);
+		    StatsClock::time_point read_start = this->stats_now();
+
+		    block.job = job;
+		    block.mapping = mapping;
+		    block.count_lines = count_lines;
+		    if (mapping != nullptr) {
+			block.in_data = mapping->data + mapped_offset;
+			block.in_nbytes = std::min(read_nbytes, mapping->nbytes - mapped_offset);
+			mapping->will_need(mapped_offset, block.in_nbytes);
+			if (split_records && mapped_offset + block.in_nbytes < mapping->nbytes) {
+			    block.in_nbytes = this->record_split_nbytes(block.in_data, block.in_nbytes);
+			}
+			mapped_offset += block.in_nbytes;
+			job_done = (mapped_offset == mapping->nbytes);
+		    } else {
+			std::copy(record_carry.begin(), record_carry.end(), block.memory.data());
+			in->read(block.memory.data() + record_carry.size(), read_nbytes - record_carry.size());
+			block.in_data = block.memory.data();
+			block.in_nbytes = record_carry.size() + in->gcount();
+			record_carry.clear();
+			job_done = !in->good();
+			if (split_records && !job_done) {
+			    size_t split_nbytes = this->record_split_nbytes(block.in_data, block.in_nbytes);
+			    record_carry.assign(block.in_data + split_nbytes, block.in_nbytes - split_nbytes);
+			    block.in_nbytes = split_nbytes;
+			}
+		    }
+		    if (this->collect_stats) {
+			this->stats.read_wait_seconds += std::chrono::duration<double>(read_start - wait_start).count();
+			this->stats.read_seconds += seconds_since(read_start);
+		    }
+
+		    // Empty input still produces one (empty) block for the
+		    // writer, which is an empty gzip member or nothing in BGZF.
+		    if (block.in_nbytes == 0 && job_n_submitted > 0) {
+			block.memory = Buffer();
+			break;
+		    }
+
+		    if (this->use_dictionary) {
+			pass_dictionary(block, dictionary_tail, job_n_submitted == 0);
+		    }
+
+		    block.compressed = this->pool.submit([this, next_block]() { this->compress_block(next_block); });
+		    {
+			std::lock_guard<std::mutex> lock(ring_mutex);
+			++n_submitted;
+		    }
+		    ++job_n_submitted;
+		    block_submitted.notify_one();
+		}
+	    }
+	} catch (...) {
+	    reader_error = std::current_exception();
+	}
+
+	{
+	    std::lock_guard<std::mutex> lock(ring_mutex);
+	    reading_done = true;
+	}
+	block_submitted.notify_one();
+	writer.join();
+
+	if (writer_error || reader_error) {
+	    // Blocks still in the pool reference the ring buffers
+	    this->pool.wait_for_tasks();
+	}
+	for (size_t i = 0; i < this->n_blocks; ++i) {
+	    this->blocks[i].mapping.reset();
+	    this->blocks[i].memory = Buffer();
+	}
+	if (writer_error || reader_error) {
+	    std::rethrow_exception(writer_error ? writer_error : reader_error);
+	}
+	if (this->collect_stats) {
+	    this->record_run(start, process_seconds_before);
+	}
+    }
+
 public:
     ParallelCompressor(size_t _n_threads, size_t _compression_level = 6, size_t _in_buffer_size = 131072, size_t _out_buffer_size = 131072) {
-	this->n_threads = (_n_threads > 0 ? _n_threads : std::thread::hardware_concurrency());
+	this->n_threads = (_n_threads > 0 ? _n_threads : available_cpu_count());
 	this->pool.reset(this->n_threads);
 
 	if (_compression_level > 12) {
@@ -73,22 +1348,24 @@ public:
 	// TODO check which ranges work and then check that they're valid
 	this->in_buffer_size = _in_buffer_size;
 	this->out_buffer_size = _out_buffer_size;
+	this->buffer_pool = std::make_shared<BufferPool>();
 
-	for (size_t i = 0; i < this->n_threads; ++i) {
-	    in_buffers.emplace_back(std::basic_string<char>());
-	    in_buffers.back().resize(this->in_buffer_size);
-
-	    out_buffers.emplace_back(std::basic_string<char>());
-	    out_buffers.back().resize(this->out_buffer_size);
+	this->n_blocks = 2*this->n_threads;
+	this->blocks = std::vector<Block>(this->n_blocks);
 
-	    this->compressors.emplace_back(libdeflate_alloc_compressor(this->compression_level));
-	}
+	// Tuned blocks are at most 4 MiB and together at most 256 MiB
+	this->max_tuned_block_nbytes = std::min(std::max((size_t)268435456/this->n_blocks, min_tuned_block_nbytes), (size_t)4194304);
+	this->tuned_block_nbytes = std::min(std::max(this->in_buffer_size, min_tuned_block_nbytes), this->max_tuned_block_nbytes);
+	this->start_workers();
     }
 
     ~ParallelCompressor() {
-	for (size_t i = 0; i < this->n_threads; ++i) {
-	    libdeflate_free_compressor(this->compressors[i]);
+	// A stream that was not finished may still have blocks in the pool
+	this->pool.wait_for_tasks();
+	for (libdeflate_compressor *compressor : this->compressors) {
+	    libdeflate_free_compressor(compressor);
 	}
+	this->free_deflate_streams();
     }
 
     // Delete copy and move constructors & copy and move assignment operators
@@ -97,31 +1374,278 @@ public:
     ParallelCompressor& operator=(const ParallelCompressor& other) = delete;
     ParallelCompressor& operator=(const ParallelCompressor&& other) = delete;
 
-    void compress_stream(std::istream *in, std::ostream *out) {
-	std::vector<bool> input_was_read(this->n_threads, false);
-	std::vector<bool> stream_still_good(this->n_threads, true);
-	while (in->good()) {
-	    std::vector<std::future<size_t>> thread_futures(this->n_threads);
-	    for (size_t i = 0; i < this->n_threads; ++i) {
-		in->read(const_cast<char*>(this->in_buffers[i].data()), this->in_buffer_size);
-		input_was_read[i] = true;
-		stream_still_good[i] = in->good();
-		if (input_was_read[i]) {
-		    thread_futures[i] = this->pool.submit(libdeflate_gzip_compress,
-							  this->compressors[i],
-							  this->in_buffers[i].data(),
-							  (stream_still_good[i] ? this->in_buffer_size : in->gcount()),
-							  const_cast<char*>(this->out_buffers[i].data()),
-							  this->out_buffer_size);
-		}
-	    }
-	    for (size_t i = 0; i < this->n_threads; ++i) {
-		if (input_was_read[i]) {
-		    size_t thread_out_nbytes = thread_futures[i].get();
-		    out->write(this->out_buffers[i].data(), thread_out_nbytes);
-		}
-		input_was_read[i] = false;
+    // Prime each block with the last 32 KiB of the previous block (like
+    // pigz) and join the blocks into a single gzip member. This gets the
+    // compression ratio close to single-threaded gzip. Levels above 9
+    // are compressed at level 9 since this mode uses zlib, and rejected
+    // with zlib or raw deflate output.
+    void set_dictionary(bool _use_dictionary) {
+	if (this->stream.open) {
+	    throw std::logic_error("can't change the output format while a stream is open.");
+	}
+	if (_use_dictionary == this->use_dictionary) {
+	    return;
+	}
+	this->use_dictionary = _use_dictionary;
+	this->init_dictionaries();
+    }
+
+    // Write a zlib or raw deflate stream instead of gzip. Since neither
+    // can be concatenated, the blocks are compressed in parallel with
+    // libdeflate and joined at sync flush points into a single stream,
+    // with the adler32 of the blocks combined for the zlib trailer.
+    void set_format(Format _format) {
+	if (this->stream.open) {
+	    throw std::logic_error("can't change the output format while a stream is open.");
+	}
+	if (_format == this->format) {
+	    return;
+	}
+	this->format = _format;
+    }
+
+    // Write BGZF (blocked gzip as used by htslib) instead of plain gzip
+    // members. Blocks are capped at 0xff00 bytes of input and the output
+    // ends with the BGZF EOF marker block.
+    void set_bgzf(bool _bgzf) {
+	if (this->stream.open) {
+	    throw std::logic_error("can't change the output format while a stream is open.");
+	}
+	this->bgzf = _bgzf;
+    }
+
+    // Choose the block size at runtime instead of using the input
+    // buffer size: blocks grow or shrink until they take about 20 ms to
+    // compress, and small inputs are split so that every thread gets
+    // blocks. The input buffer size is the starting point.
+    void set_auto_block_size(bool _auto_block_size) {
+	if (this->stream.open) {
+	    throw std::logic_error("can't change the block size while a stream is open.");
+	}
+	this->auto_block_size = _auto_block_size;
+    }
+
+    // End full blocks at the last record boundary in them instead of at
+    // the block size, so that no record spans two gzip members and the
+    // members can be decompressed and parsed independently. Records are
+    // lines, or FASTQ records of four lines. A record that is longer
+    // than a block is still split. Can't be used with a dictionary.
+    void set_record_format(RecordFormat _record_format) {
+	if (this->stream.open) {
+	    throw std::logic_error("can't change the record format while a stream is open.");
+	}
+	this->record_format = _record_format;
+    }
+
+    // Take the memory of the blocks in flight from `_buffer_pool`, which
+    // can be shared with other compressors and decompressors so that
+    // they stay within its limit together. When the pool is at its
+    // limit, the reader waits for blocks to be written before reading
+    // more, so fewer blocks are in flight instead of memory running out.
+    void set_buffer_pool(std::shared_ptr<BufferPool> _buffer_pool) {
+	if (this->stream.open) {
+	    throw std::logic_error("can't change the buffer pool while a stream is open.");
+	}
+	this->buffer_pool = std::move(_buffer_pool);
+    }
+
+    // Open the output files with O_DIRECT so that large archives don't
+    // fill the page cache. Ignored for stdout and for streams passed in,
+    // and where the file system does not support it.
+    void set_direct_io(bool _direct_io) {
+	this->direct_io = _direct_io;
+    }
+
+    // Pin the worker threads to `_cpus`, one CPU per worker in turn, so
+    // that several compressors can run side by side on separate CPUs or
+    // sockets. Each worker's compressor and deflate state are allocated
+    // again on the worker and the memory it touches first, like the
+    // output of the blocks it compresses, is then placed on its NUMA
+    // node. The reader and writer threads run on the CPUs of the calling
+    // thread. An empty list lets the workers run anywhere again.
+    void set_cpus(const std::vector<int> &_cpus) {
+	if (this->stream.open) {
+	    throw std::logic_error("can't change the CPUs while a stream is open.");
+	}
+	if (_cpus == this->cpus) {
+	    return;
+	}
+	if (!this->cpus.empty()) {
+	    // Undo the previous pinning by starting new threads
+	    this->pool.reset(this->n_threads);
+	}
+	this->cpus = _cpus;
+	try {
+	    this->start_workers();
+	} catch (...) {
+	    this->cpus.clear();
+	    this->pool.reset(this->n_threads);
+	    this->start_workers();
+	    throw;
+	}
+    }
+
+    // Collect the timings and counters that `get_stats` returns. This
+    // also resets the stats collected so far.
+    void set_stats(bool _collect_stats) {
+	this->collect_stats = _collect_stats;
+	this->stats = Stats();
+    }
+
+    const Stats& get_stats() const {
+	return this->stats;
+    }
+
+    // Compress `in` to `out`. In BGZF mode a .gzi index of the block
+    // offsets is written to `gzi_out` if it is not a nullptr. With a
+    // record format, an index of the records in each member is written
+    // to `record_index_out` if it is not a nullptr (see the README).
+    void compress_stream(std::istream *in, std::ostream *out, std::ostream *gzi_out = nullptr,
+			 std::ostream *record_index_out = nullptr) {
+	std::vector<Job> jobs(1);
+	jobs[0].in = in;
+	jobs[0].out = out;
+	jobs[0].gzi_out = gzi_out;
+	jobs[0].record_index_out = record_index_out;
+	this->compress_jobs(jobs);
+    }
+
+    // Compress each file in `in_paths` to the same index in `out_paths`
+    // (stdout if the path is empty). The files are compressed together
+    // so many small files keep all threads busy, and each output is
+    // written in order. In BGZF mode the .gzi index of each file is
+    // written to the path in `gzi_paths` if it is given and not empty,
+    // and likewise the record index to the path in `record_index_paths`.
+    void compress_files(const std::vector<std::string> &in_paths, const std::vector<std::string> &out_paths,
+			const std::vector<std::string> &gzi_paths = std::vector<std::string>(),
+			const std::vector<std::string> &record_index_paths = std::vector<std::string>()) {
+	if (in_paths.size() != out_paths.size() || (!gzi_paths.empty() && gzi_paths.size() != in_paths.size()) ||
+	    (!record_index_paths.empty() && record_index_paths.size() != in_paths.size())) {
+	    throw std::invalid_argument("the number of input and output paths must match.");
+	}
+	std::vector<Job> jobs(in_paths.size());
+	for (size_t i = 0; i < in_paths.size(); ++i) {
+	    jobs[i].in_path = in_paths[i];
+	    jobs[i].out_path = out_paths[i];
+	    if (!gzi_paths.empty()) {
+		jobs[i].gzi_path = gzi_paths[i];
+	    }
+	    if (!record_index_paths.empty()) {
+		jobs[i].record_index_path = record_index_paths[i];
+	    }
+	}
+	this->compress_jobs(jobs);
+    }
+
+    // Start compressing a stream that is pushed in with `write`. The
+    // compressed output is passed to `sink` in order, on the thread that
+    // calls `open`, `write`, `flush`, or `finish`.
+    void open(std::function<void(const char*, size_t)> sink) {
+	this->check_options();
+	if (this->stream.open) {
+	    throw std::logic_error("a stream is already open.");
+	}
+	this->stream = Stream();
+	this->stream.sink = std::move(sink);
+	this->stream.open = true;
+	this->stream.check = this->initial_check();
+	this->stream.start = this->stats_now();
+	this->stream.process_seconds_before = this->stats.process_seconds;
+	if (this->single_stream()) {
+	    char header[10];
+	    size_t header_nbytes = this->put_stream_header(header);
+	    if (header_nbytes > 0) {
+		this->stream.sink(header, header_nbytes);
+	    }
+	}
+    }
+
+    // Append `nbytes` from `data` to the open stream. Full blocks are
+    // compressed in the pool while `write` returns. If all blocks are
+    // in flight, `write` waits for the oldest one and passes it to the
+    // sink before taking more input.
+    void write(const void *data, size_t nbytes) {
+	if (!this->stream.open) {
+	    throw std::logic_error("write called without an open stream.");
+	}
+	const char *src = static_cast<const char*>(data);
+	try {
+	    while (nbytes > 0) {
+		if (this->stream.fill_nbytes == 0) {
+		    this->stream_start_block();
+		}
+		Block &block = this->blocks[this->stream.n_submitted % this->n_blocks];
+		size_t len = std::min(nbytes, this->stream.fill_capacity - this->stream.fill_nbytes);
+		std::copy(src, src + len, block.memory.data() + this->stream.fill_nbytes);
+		this->stream.fill_nbytes += len;
+		src += len;
+		nbytes -= len;
+		if (this->stream.fill_nbytes == this->stream.fill_capacity) {
+		    this->stream_submit(true);
+		}
 	    }
+	} catch (...) {
+	    this->abort_stream();
+	    throw;
+	}
+    }
+
+    // Compress the partial block and pass all output so far to the
+    // sink. The output then decompresses to everything written before.
+    void flush() {
+	if (!this->stream.open) {
+	    throw std::logic_error("flush called without an open stream.");
+	}
+	try {
+	    if (this->stream.fill_nbytes == 0 && !this->stream.record_carry.empty()) {
+		this->stream_start_block();
+	    }
+	    if (this->stream.fill_nbytes > 0) {
+		this->stream_submit(false);
+	    }
+	    while (this->stream.n_written < this->stream.n_submitted) {
+		this->stream_write_oldest();
+	    }
+	} catch (...) {
+	    this->abort_stream();
+	    throw;
+	}
+    }
+
+    // Flush the stream, end it with the trailer of the format, and
+    // close it. The compressor can then be reused.
+    void finish() {
+	if (!this->stream.open) {
+	    throw std::logic_error("finish called without an open stream.");
+	}
+	try {
+	    if (this->stream.n_submitted == 0 && this->stream.fill_nbytes == 0 && !this->single_stream()) {
+		// Empty input is an empty gzip member, or nothing in BGZF
+		this->stream_submit(false);
+	    }
+	    this->flush();
+	    if (this->single_stream()) {
+		char trailer[10];
+		this->stream.sink(trailer, this->put_stream_trailer(trailer, this->stream.check, this->stream.total_in_nbytes));
+	    }
+	    if (this->bgzf) {
+		this->stream.sink(bgzf_eof_block, 28);
+	    }
+	} catch (...) {
+	    this->abort_stream();
+	    throw;
+	}
+	if (this->collect_stats) {
+	    this->record_run(this->stream.start, this->stream.process_seconds_before);
+	}
+	this->stream = Stream();
+    }
+
+    // Drop the open stream without writing the rest of it, e.g. when
+    // reading its input failed. The compressor can then be reused.
+    void abort() {
+	if (this->stream.open) {
+	    this->abort_stream();
 	}
     }
 };
@@ -35,33 +35,119 @@
 #include <vector>
 #include <string>
 #include <exception>
+#include <stdexcept>
 #include <thread>
 #include <future>
 #include <cmath>
 #include <algorithm>
+#include <limits>
+#include <filesystem>
+#include <mutex>
+#include <iostream>
+#include <functional>
+#include <streambuf>
 
 #include "zlib.h"
+#include "libdeflate.h"
 #include "rapidgzip.hpp"
+#include "filereader/Standard.hpp"
+#include "filereader/SinglePass.hpp"
+#include "filereader/BufferView.hpp"
 #include "BS_thread_pool.hpp"
 
+#include "tigz_mapped_file.hpp"
+#include "tigz_stats.hpp"
+#include "tigz_buffer_pool.hpp"
+#include "tigz_affinity.hpp"
+#include "tigz_format.hpp"
+
 namespace tigz {
+// Outcome of checking a compressed file with `ParallelDecompressor::test_file`
+struct TestResult {
+    bool ok = true;
+
+    // Offset of the first corrupt member in the compressed input,
+    // or max if it could not be located.
+    size_t member_offset = std::numeric_limits<size_t>::max();
+
+    std::string error;
+};
+
 class ParallelDecompressor {
 private:
+    // Stream buffer that passes everything written to it to a sink so
+    // that the single-threaded decompressors can write to it.
+    class SinkBuffer : public std::streambuf {
+    private:
+	const std::function<void(const char*, size_t)> &sink;
+
+    protected:
+	std::streamsize xsputn(const char *data, std::streamsize nbytes) override {
+	    this->sink(data, nbytes);
+	    return nbytes;
+	}
+	int_type overflow(int_type c) override {
+	    if (!traits_type::eq_int_type(c, traits_type::eof())) {
+		char byte = traits_type::to_char_type(c);
+		this->sink(&byte, 1);
+	    }
+	    return traits_type::not_eof(c);
+	}
+
+    public:
+	explicit SinkBuffer(const std::function<void(const char*, size_t)> &_sink) : sink(_sink) {}
+    };
+
+    // Stream buffer that reads from memory without copying it, for
+    // streaming the rest of a buffer through zlib.
+    class ViewBuffer : public std::streambuf {
+    public:
+	ViewBuffer(const char *data, size_t nbytes) {
+	    char *begin = const_cast<char*>(data);
+	    this->setg(begin, begin, begin + nbytes);
+	}
+    };
+
+
     // Size for internal i/o buffers
     size_t io_buffer_size;
 
-    // Number of threads to use in file decompression
+    // Number of threads to use in file decompression, and the CPUs they
+    // run on if not empty
     size_t n_threads;
+    std::vector<int> cpus;
+
+    // Container of the compressed inputs. rapidgzip is only used for
+    // gzip; zlib and raw deflate inputs are decompressed with one thread
+    // per file.
+    Format format = Format::gzip;
+
+    // Memory for the single-threaded buffers, possibly shared with others
+    std::shared_ptr<BufferPool> buffer_pool;
+
+    // Paths to read or write the rapidgzip index of block and window offsets
+    std::string import_index_path;
+    std::string export_index_path;
+
+    // Timings and counters, if enabled. Files decompressed concurrently
+    // collect their own stats which are then merged under the mutex.
+    bool collect_stats = false;
+    mutable Stats stats;
+    mutable std::mutex stats_mutex;
 
     // Decompress from `source` to `dest` with a single thread.
     // This function is used for unseekable streams since they
     // cannot be decompressed in parallel.
-    int decompress_with_single_thread(std::istream *source, std::ostream *dest) const {
+    int decompress_with_single_thread(std::istream *source, std::ostream *dest, size_t *error_offset = nullptr, Stats *stats = nullptr) const {
 	// Input:
 	//   `source`: deflate/zlib/gzip format compressed binary data.
 	//
 	// Output:
-	//   `dest`: writable stream for uncompressed output.
+	//   `dest`: writable stream for uncompressed output, or nullptr
+	//           to only check the data.
+	//   `error_offset`: if not nullptr, set to the offset of the
+	//                   member in `source` where decompression failed.
+	//   `stats`: if not nullptr, timings and counters are added to it.
 	//
 	// Return value:
 	//    Z_OK: if decompression ended at a deflate/zlib/gzip footer
@@ -75,28 +161,40 @@ private:
 	strm.avail_in = 0;
 	strm.next_in = Z_NULL;
 
-	// deflate window size
-	size_t window_size = 15+32;
+	// deflate window size, detecting the gzip or zlib header for gzip
+	int window_size = (this->format == Format::gzip ? 15+32 : (this->format == Format::zlib ? 15 : -15));
 
 	// Init stream state
-	int ret = (window_size == 0 ? inflateInit(&strm) : inflateInit2(&strm, window_size));
+	int ret = inflateInit2(&strm, window_size);
 
 	if (ret != Z_OK)
 	    return ret;
 
+	// The buffers and the inflate state are reused for the whole stream.
+	// Both buffers are taken at once so that waiting for the pool never
+	// holds memory.
+	Buffer buffers = this->buffer_pool->acquire(2*this->io_buffer_size);
+	unsigned char *in = reinterpret_cast<unsigned char*>(buffers.data());
+	unsigned char *out = in + this->io_buffer_size;
+
+	// Offset of the current member in `source`
+	size_t member_offset = 0;
+	if (error_offset != nullptr) {
+	    *error_offset = member_offset;
+	}
+
 	// Decompress until stream ends
 	while (source->good()) {
-	    // Keep track of total compressed bytes available and processed
-	    size_t nbytes_available = 0;
-	    size_t nbytes_consumed = 0;
-
 	    // Read `io_buffer_size` bytes into buffer
-	    std::basic_string<unsigned char> in(this->io_buffer_size, '-');
-	    source->read(reinterpret_cast<char*>(in.data()), this->io_buffer_size);
+	    StatsClock::time_point read_start = (stats != nullptr ? StatsClock::now() : StatsClock::time_point());
+	    source->read(reinterpret_cast<char*>(in), this->io_buffer_size);
 
 	    // If at end of stream the number of bytes read will be less than total buffer size
-	    nbytes_available = source->gcount();
-	    strm.avail_in = nbytes_available;
+	    strm.avail_in = source->gcount();
+	    if (stats != nullptr) {
+		stats->read_seconds += seconds_since(read_start);
+		stats->in_nbytes += strm.avail_in;
+	    }
 
 	    // Check that the read succeeded
 	    if (source->fail() && !source->eof()) {
@@ -108,38 +206,29 @@ private:
 	    if (strm.avail_in == 0)
 		break;
 
-	    // Pointers to first byte in `in`
-	    strm.next_in = in.data();
-	    unsigned char* next_to_consume = in.data();
-	    do {
-		// Check how much buffer there is left to consume
-		size_t in_left_to_consume = nbytes_available - nbytes_consumed;
-		next_to_consume = &in.data()[nbytes_consumed]; // Already consumed `nbytes_consumed` from `in`
-
+	    strm.next_in = in;
+	    while (strm.avail_in > 0) {
 		// Check if the previous inflate() ended at concatenated deflate block boundary
 		if (ret == Z_STREAM_END) {
-		    // Buffer contains another deflate block starting at `next_to_consume`:
-		    // need to reset the stream state.
-		    (void)inflateEnd(&strm);
-		    strm.zalloc = Z_NULL;
-		    strm.zfree = Z_NULL;
-		    strm.opaque = Z_NULL;
-		    strm.avail_in = 0;
-		    strm.next_in = Z_NULL;
-		    ret = (window_size == 0 ? inflateInit(&strm) : inflateInit2(&strm, window_size));
-
-		    // Update stream input state
-		    strm.next_in = next_to_consume;
-		    strm.avail_in = in_left_to_consume;
+		    // Buffer contains another member starting at `strm.next_in`:
+		    // reset the stream state but keep the input position.
+		    member_offset += strm.total_in;
+		    if (error_offset != nullptr) {
+			*error_offset = member_offset;
+		    }
+		    (void)inflateReset(&strm);
 		}
 
 		// Inflate `in` until outbuffer `out` is not full (= `in` has nothing left to inflate)
-		std::basic_string<unsigned char> out(this->io_buffer_size, '-');
 		do {
 		    // Update stream output state
 		    strm.avail_out = this->io_buffer_size;
-		    strm.next_out = out.data();
+		    strm.next_out = out;
+		    StatsClock::time_point inflate_start = (stats != nullptr ? StatsClock::now() : StatsClock::time_point());
 		    ret = inflate(&strm, Z_NO_FLUSH); // Inflate `in`
+		    if (stats != nullptr) {
+			stats->add_process_seconds(std::this_thread::get_id(), seconds_since(inflate_start));
+		    }
 
 		    // Check that inflate() succeeded
 		    // TODO exceptions
@@ -157,18 +246,24 @@ private:
 
 		    // Check size of the inflated output and write to `dest`
 		    size_t have = this->io_buffer_size - strm.avail_out;
-		    dest->write(reinterpret_cast<char*>(out.data()), have);
-
-		    // Check that the write succeeded
-		    if (dest->fail()) {
-			(void)inflateEnd(&strm);
-			return Z_ERRNO;
+		    if (stats != nullptr) {
+			stats->out_nbytes += have;
 		    }
-		} while (strm.avail_out == 0);
+		    if (dest != nullptr) {
+			StatsClock::time_point write_start = (stats != nullptr ? StatsClock::now() : StatsClock::time_point());
+			dest->write(reinterpret_cast<char*>(out), have);
+			if (stats != nullptr) {
+			    stats->write_seconds += seconds_since(write_start);
+			}
 
-		// Update nbytes consumed
-		nbytes_consumed += strm.next_in - next_to_consume;
-	    } while (nbytes_consumed < nbytes_available);
+			// Check that the write succeeded
+			if (dest->fail()) {
+			    (void)inflateEnd(&strm);
+			    return Z_ERRNO;
+			}
+		    }
+		} while (strm.avail_out == 0 && ret != Z_STREAM_END);
+	    }
 	}
 	// Done
 	(void)inflateEnd(&strm);
@@ -177,53 +272,682 @@ private:
 	return ret == Z_STREAM_END ? Z_OK : Z_DATA_ERROR;
     }
 
-    // Multithreaded decompression with rapidgzip
-    void decompress_with_many_threads(UniqueFileReader &inputFile, std::unique_ptr<OutputFile> &output_file) const {
+    // Decompress one gzip member, or zlib or raw deflate stream, from
+    // the start of `in` with libdeflate
+    libdeflate_result decompress_member(libdeflate_decompressor *decompressor, const char *in, size_t in_nbytes,
+					char *out, size_t out_capacity, size_t *actual_in_nbytes, size_t *actual_out_nbytes) const {
+	if (this->format == Format::zlib) {
+	    return libdeflate_zlib_decompress_ex(decompressor, in, in_nbytes, out, out_capacity, actual_in_nbytes, actual_out_nbytes);
+	} else if (this->format == Format::deflate) {
+	    return libdeflate_deflate_decompress_ex(decompressor, in, in_nbytes, out, out_capacity, actual_in_nbytes, actual_out_nbytes);
+	}
+	return libdeflate_gzip_decompress_ex(decompressor, in, in_nbytes, out, out_capacity, actual_in_nbytes, actual_out_nbytes);
+    }
+
+    // Decompress the `in_nbytes` bytes of compressed data at `in` to
+    // `dest` with a single thread, one whole member (or zlib or raw
+    // deflate stream) at a time with libdeflate, which is much faster
+    // than streaming through zlib. Members that decompress to more than
+    // `max_member_nbytes` or to more than the memory limit are streamed
+    // through `decompress_with_single_thread` instead. The buffer for a
+    // gzip file of one member is sized from its ISIZE trailer.
+    //
+    // Returns Z_OK on success or the same error codes as
+    // `decompress_with_single_thread`, which also describes `dest`,
+    // `error_offset`, and `stats`.
+    int decompress_memory_with_single_thread(const char *in, size_t in_total_nbytes, std::ostream *dest, size_t *error_offset = nullptr, Stats *stats = nullptr) const {
+	constexpr size_t max_member_nbytes = 67108864;
+
+	std::unique_ptr<libdeflate_decompressor, decltype(&libdeflate_free_decompressor)>
+	    decompressor(libdeflate_alloc_decompressor(), &libdeflate_free_decompressor);
+	if (decompressor == nullptr) {
+	    return Z_MEM_ERROR;
+	}
+
+	// The output buffer grows until the largest member fits
+	size_t out_capacity = std::max(this->io_buffer_size, (size_t)65536);
+	Buffer out = this->buffer_pool->acquire(out_capacity);
+	size_t limit = this->buffer_pool->limit();
+	bool tried_isize = false;
+
+	size_t in_offset = 0;
+	while (in_offset < in_total_nbytes) {
+	    size_t in_nbytes = 0;
+	    size_t out_nbytes = 0;
+	    StatsClock::time_point member_start = (stats != nullptr ? StatsClock::now() : StatsClock::time_point());
+	    libdeflate_result result = decompress_member(decompressor.get(),
+							 in + in_offset,
+							 in_total_nbytes - in_offset,
+							 out.data(),
+							 out_capacity,
+							 &in_nbytes,
+							 &out_nbytes);
+	    if (result == LIBDEFLATE_INSUFFICIENT_SPACE) {
+		size_t next_capacity = 2*out_capacity;
+		if (in_offset == 0 && this->format == Format::gzip && !tried_isize && in_total_nbytes >= 18) {
+		    // If the input is a single member, the ISIZE at its end
+		    // is the decompressed size: take that at once, or stream
+		    // right away if it is too large, instead of growing.
+		    tried_isize = true;
+		    size_t isize = 0;
+		    for (size_t i = 0; i < 4; ++i) {
+			isize |= (size_t)(unsigned char)in[in_total_nbytes - 4 + i] << (8*i);
+		    }
+		    next_capacity = std::max(next_capacity, isize);
+		}
+		if (next_capacity <= max_member_nbytes && (limit == 0 || next_capacity <= limit)) {
+		    // Return the old buffer first so that waiting holds no memory
+		    out_capacity = next_capacity;
+		    out = Buffer();
+		    out = this->buffer_pool->acquire(out_capacity);
+		    continue;
+		}
+	    }
+	    if (result == LIBDEFLATE_INSUFFICIENT_SPACE || (result != LIBDEFLATE_SUCCESS && in_offset == 0)) {
+		// Stream the rest of the data instead of holding a huge
+		// member, or let zlib detect the format if it isn't gzip.
+		out = Buffer();
+		ViewBuffer rest(in + in_offset, in_total_nbytes - in_offset);
+		std::istream in_stream(&rest);
+		int ret = this->decompress_with_single_thread(&in_stream, dest, error_offset, stats);
+		if (error_offset != nullptr) {
+		    *error_offset += in_offset;
+		}
+		return ret;
+	    } else if (result != LIBDEFLATE_SUCCESS) {
+		if (error_offset != nullptr) {
+		    *error_offset = in_offset;
+		}
+		return Z_DATA_ERROR;
+	    }
+
+	    if (stats != nullptr) {
+		// Time spent in failed attempts with too small buffers is included
+		stats->add_process_seconds(std::this_thread::get_id(), seconds_since(member_start));
+		stats->in_nbytes += in_nbytes;
+		stats->out_nbytes += out_nbytes;
+		stats->add_block(out_nbytes, in_nbytes);
+	    }
+
+	    if (dest != nullptr) {
+		StatsClock::time_point write_start = (stats != nullptr ? StatsClock::now() : StatsClock::time_point());
+		dest->write(out.data(), out_nbytes);
+		if (dest->fail()) {
+		    return Z_ERRNO;
+		}
+		if (stats != nullptr) {
+		    stats->write_seconds += seconds_since(write_start);
+		}
+	    }
+	    in_offset += in_nbytes;
+	}
+
+	return Z_OK;
+    }
+
+    // Decompress the file `in_path` to `dest` with a single thread.
+    // Regular files are mapped to memory and decompressed with
+    // `decompress_memory_with_single_thread`; inputs that can't be
+    // mapped are streamed with `decompress_with_single_thread`.
+    int decompress_file_with_single_thread(const std::string &in_path, std::ostream *dest, size_t *error_offset = nullptr, Stats *stats = nullptr) const {
+	std::shared_ptr<const MappedFile> in = MappedFile::map(in_path);
+	if (in == nullptr) {
+	    std::ifstream in_stream(in_path);
+	    return this->decompress_with_single_thread(&in_stream, dest, error_offset, stats);
+	}
+	return this->decompress_memory_with_single_thread(in->data, in->nbytes, dest, error_offset, stats);
+    }
+
+    // Multithreaded decompression with rapidgzip. If `sink` is not
+    // nullptr the decompressed chunks are passed to it in order straight
+    // from rapidgzip's buffers instead of writing them to `output_file`.
+    // If neither is given the data is only decoded and the crc32 of each
+    // member is checked, which throws if the data is corrupt. The time
+    // spent writing and waiting for chunks is added to `stats` if it is
+    // not a nullptr.
+    void decompress_with_many_threads(UniqueFileReader &inputFile, std::unique_ptr<OutputFile> &output_file,
+				      size_t offset = 0, size_t length = std::numeric_limits<size_t>::max(),
+				      Stats *stats = nullptr, const std::function<void(const char*, size_t)> *sink = nullptr,
+				      size_t n_reader_threads = 0) const {
 	const auto outputFileDescriptor = output_file ? output_file->fd() : -1;
 	const auto writeAndCount =
-	    [outputFileDescriptor, this]
+	    [outputFileDescriptor, stats, sink, this]
 	    (const std::shared_ptr<rapidgzip::ChunkData>& chunkData,
 	     size_t const offsetInBlock,
 	     size_t const dataToWriteSize) {
-		writeAll(chunkData, outputFileDescriptor, offsetInBlock, dataToWriteSize);
+		StatsClock::time_point write_start = (stats != nullptr ? StatsClock::now() : StatsClock::time_point());
+		if (sink != nullptr) {
+		    using rapidgzip::deflate::DecodedData;
+		    for (auto it = DecodedData::Iterator(*chunkData, offsetInBlock, dataToWriteSize); static_cast<bool>(it); ++it) {
+			const auto &[buffer, nbytes] = *it;
+			(*sink)(reinterpret_cast<const char*>(buffer), nbytes);
+		    }
+		} else if (outputFileDescriptor >= 0) {
+		    writeAll(chunkData, outputFileDescriptor, offsetInBlock, dataToWriteSize);
+		}
+		if (stats != nullptr) {
+		    stats->write_seconds += seconds_since(write_start);
+		    stats->out_nbytes += dataToWriteSize;
+		}
 	    };
 
 	using Reader = rapidgzip::ParallelGzipReader<rapidgzip::ChunkData,
 						     /* enable statistics */ false>;
-	auto reader = std::make_unique<Reader>(std::move(inputFile), this->n_threads, this->io_buffer_size);
-	reader->read(writeAndCount);
+	std::unique_ptr<Reader> reader;
+	{
+	    // rapidgzip starts its threads here and they inherit the CPUs
+	    ScopedThreadCpus on_cpus(this->cpus);
+	    reader = std::make_unique<Reader>(std::move(inputFile), (n_reader_threads > 0 ? n_reader_threads : this->thread_count()), this->io_buffer_size);
+	}
+	if (!output_file && sink == nullptr) {
+	    reader->setCRC32Enabled(true);
+	}
+	if (!this->import_index_path.empty()) {
+	    // Skips searching for the deflate blocks
+	    reader->importIndex(std::make_unique<StandardFileReader>(this->import_index_path));
+	}
+
+	if (offset > 0) {
+	    reader->seek(offset);
+	}
+	StatsClock::time_point read_start = (stats != nullptr ? StatsClock::now() : StatsClock::time_point());
+	double write_seconds_before = (stats != nullptr ? stats->write_seconds : 0.0);
+	reader->read(writeAndCount, length);
+	if (stats != nullptr) {
+	    // The rest of the time went to waiting for the decompressed chunks
+	    stats->write_wait_seconds += seconds_since(read_start) - (stats->write_seconds - write_seconds_before);
+	}
+
+	if (!this->export_index_path.empty()) {
+	    std::ofstream index_file(this->export_index_path, std::ios::binary);
+	    const auto checkedWrite =
+		[&index_file, this]
+		(const void* buffer, size_t size) {
+		    index_file.write(reinterpret_cast<const char*>(buffer), size);
+		    if (index_file.fail()) {
+			throw std::runtime_error("writing the index to " + this->export_index_path + " failed.");
+		    }
+		};
+	    reader->exportIndex(checkedWrite);
+	}
     }
 
-public:
-    ParallelDecompressor(size_t _n_threads, size_t _io_buffer_size = 131072) {
-	this->n_threads = _n_threads;
-	this->io_buffer_size = _io_buffer_size;
+    // Open `in_path` for rapidgzip, or stdin if `in_path` is empty
+    UniqueFileReader open_input(const std::string &in_path) const {
+	auto inputFile = openFileOrStdin(in_path);
+
+	// Pipes can't be seeked: decompress them in a single pass that
+	// only buffers the compressed data the threads are still using.
+	if (!inputFile->seekable() && dynamic_cast<SinglePassFileReader*>(inputFile.get()) == nullptr) {
+	    inputFile = std::make_unique<SinglePassFileReader>(std::move(inputFile));
+	}
+	return inputFile;
     }
 
-    void decompress_stream(std::istream *in, std::ostream *out) const {
-	this->decompress_with_single_thread(in, out);
+    // Decompress `inputFile` with rapidgzip and pass the chunks to `sink`
+    void decompress_with_many_threads_to(UniqueFileReader &inputFile, const std::function<void(const char*, size_t)> &sink, Stats *stats) const {
+	std::unique_ptr<OutputFile> no_output;
+	this->decompress_with_many_threads(inputFile, no_output, 0, std::numeric_limits<size_t>::max(), stats, &sink);
+    }
+
+    // Sink that copies the data to `out` and counts it in `out_nbytes`.
+    // Throws std::length_error if it does not fit in `out_capacity`.
+    static std::function<void(const char*, size_t)> copy_to(char *out, size_t out_capacity, size_t &out_nbytes) {
+	return [out, out_capacity, &out_nbytes](const char *data, size_t nbytes) {
+	    if (nbytes > out_capacity - out_nbytes) {
+		throw std::length_error("the decompressed data does not fit in the buffer.");
+	    }
+	    std::copy(data, data + nbytes, out + out_nbytes);
+	    out_nbytes += nbytes;
+	};
+    }
+
+    // Sink that appends the data to `out`
+    static std::function<void(const char*, size_t)> append_to(std::vector<char> &out) {
+	return [&out](const char *data, size_t nbytes) {
+	    out.insert(out.end(), data, data + nbytes);
+	};
     }
 
-    void decompress_file(const std::string &in_path, std::string &out_path) const {
-        if (this->n_threads == 1) {
-	    std::ifstream in(in_path);
+    // Threads to use when `n_threads` is 0: one per CPU they may run on
+    size_t thread_count() const {
+	if (this->n_threads > 0) {
+	    return this->n_threads;
+	}
+	return (this->cpus.empty() ? available_cpu_count() : this->cpus.size());
+    }
+
+    // If files are decompressed with rapidgzip instead of one thread
+    bool uses_rapidgzip() const {
+	return this->n_threads != 1 && this->format == Format::gzip;
+    }
+
+    // Stats to collect a run into, or nullptr if stats are disabled
+    Stats* stats_for(Stats *run) const {
+	return (this->collect_stats ? run : nullptr);
+    }
+
+    // Add `run`, which started at `start`, to the stats
+    void record_run(Stats &run, const StatsClock::time_point &start) const {
+	if (!this->collect_stats) {
+	    return;
+	}
+	run.n_threads = std::max(run.n_threads, this->thread_count());
+	run.wall_seconds = seconds_since(start);
+	std::lock_guard<std::mutex> lock(this->stats_mutex);
+	this->stats.merge(run);
+    }
+
+    // Add the stats of files that were processed on a pool of
+    // `n_pool_threads` threads starting from `pool_start` to `run`
+    void record_pool_run(Stats &run, const std::vector<Stats> &file_stats, size_t n_pool_threads,
+			 const StatsClock::time_point &pool_start) const {
+	if (!this->collect_stats) {
+	    return;
+	}
+	Stats pool_run;
+	for (const Stats &file : file_stats) {
+	    pool_run.merge(file);
+	}
+	pool_run.idle_seconds = std::max(n_pool_threads*seconds_since(pool_start) - pool_run.process_seconds, 0.0);
+	run.merge(pool_run);
+    }
+
+    // Decompress one file as described in `decompress_file`. rapidgzip
+    // runs on `n_reader_threads` threads, or all of them if 0.
+    void decompress_one_file(const std::string &in_path, std::string &out_path,
+			     size_t offset, size_t length, Stats *stats, size_t n_reader_threads = 0) const {
+	bool needs_rapidgzip = (offset > 0 || length != std::numeric_limits<size_t>::max() ||
+				!this->import_index_path.empty() || !this->export_index_path.empty());
+	if (needs_rapidgzip && this->format != Format::gzip) {
+	    throw std::invalid_argument("ranges and indexes are only supported for gzip input.");
+	}
+        if (!this->uses_rapidgzip() && !needs_rapidgzip) {
 	    if (out_path.empty()) {
-		this->decompress_with_single_thread(&in, &std::cout);
+		int ret = (in_path.empty() ? this->decompress_with_single_thread(&std::cin, &std::cout, nullptr, stats)
+					   : this->decompress_file_with_single_thread(in_path, &std::cout, nullptr, stats));
+		if (ret != Z_OK) {
+		    throw std::runtime_error("decompressing " + (in_path.empty() ? std::string("stdin") : in_path) + " failed.");
+		}
 	    } else {
-		std::ofstream out(out_path);
-		this->decompress_with_single_thread(&in, &out);
-		out.close();
+		this->decompress_file_to(in_path, out_path, stats);
 	    }
-	    in.close();
         } else {
-	    auto inputFile = openFileOrStdin(in_path);
+	    auto inputFile = this->open_input(in_path);
 
 	    std::unique_ptr<OutputFile> outputFile;
 	    outputFile = std::make_unique<OutputFile>(out_path); // Opens cout if out_path is empty
 
-	    this->decompress_with_many_threads(inputFile, outputFile);
+	    if (stats != nullptr && !in_path.empty() && !needs_rapidgzip) {
+		stats->in_nbytes += std::filesystem::file_size(in_path);
+	    }
+	    this->decompress_with_many_threads(inputFile, outputFile, offset, length, stats, nullptr, n_reader_threads);
         }
     }
+
+    // Decompress `in_path` (stdin if empty) on the calling thread to
+    // the file `out_path`. Throws if either fails, including when the
+    // output could not be written completely.
+    void decompress_file_to(const std::string &in_path, const std::string &out_path, Stats *stats) const {
+	std::ofstream out(out_path, std::ios::binary);
+	if (!out.is_open()) {
+	    throw std::runtime_error("can't open " + out_path + " for writing.");
+	}
+	int ret = (in_path.empty() ? this->decompress_with_single_thread(&std::cin, &out, nullptr, stats)
+				   : this->decompress_file_with_single_thread(in_path, &out, nullptr, stats));
+	if (ret != Z_OK) {
+	    throw std::runtime_error("decompressing " + (in_path.empty() ? std::string("stdin") : in_path) + " failed.");
+	}
+	out.close();
+	if (out.fail()) {
+	    throw std::runtime_error("writing " + out_path + " failed.");
+	}
+    }
+
+    // Test one file that is small enough to not need rapidgzip
+    TestResult test_with_single_thread(const std::string &in_path, Stats *stats) const {
+	TestResult result;
+	size_t error_offset = 0;
+	int ret = (in_path.empty() ? this->decompress_with_single_thread(&std::cin, nullptr, &error_offset, stats)
+				   : this->decompress_file_with_single_thread(in_path, nullptr, &error_offset, stats));
+	if (ret != Z_OK) {
+	    result.ok = false;
+	    result.member_offset = error_offset;
+	    result.error = (ret == Z_ERRNO ? "read error" : "invalid compressed data");
+	}
+	return result;
+    }
+
+    // Test one file as described in `test_file`
+    TestResult test_one_file(const std::string &in_path, Stats *stats) const {
+	if (!this->uses_rapidgzip()) {
+	    return this->test_with_single_thread(in_path, stats);
+	}
+
+	TestResult result;
+	try {
+	    auto inputFile = this->open_input(in_path);
+	    std::unique_ptr<OutputFile> no_output;
+	    if (stats != nullptr && !in_path.empty()) {
+		stats->in_nbytes += std::filesystem::file_size(in_path);
+	    }
+	    this->decompress_with_many_threads(inputFile, no_output, 0, std::numeric_limits<size_t>::max(), stats);
+	} catch (const std::exception &e) {
+	    result.ok = false;
+	    result.error = e.what();
+	    size_t error_offset = 0;
+	    if (!in_path.empty() && this->decompress_file_with_single_thread(in_path, nullptr, &error_offset) != Z_OK) {
+		result.member_offset = error_offset;
+	    }
+	}
+	return result;
+    }
+
+public:
+    ParallelDecompressor(size_t _n_threads, size_t _io_buffer_size = 131072) {
+	this->n_threads = _n_threads;
+	this->io_buffer_size = _io_buffer_size;
+	this->buffer_pool = std::make_shared<BufferPool>();
+    }
+
+    // Run the decompression threads, both rapidgzip's and the pool
+    // decompressing small files concurrently, on `_cpus`. With 0 threads
+    // one thread per CPU is used.
+    void set_cpus(const std::vector<int> &_cpus) {
+	this->cpus = _cpus;
+    }
+
+    // Decompress zlib or raw deflate instead of gzip input. These are
+    // decompressed with libdeflate or zlib on one thread per file, so
+    // many files are still decompressed in parallel.
+    void set_format(Format _format) {
+	this->format = _format;
+    }
+
+    // Take the single-threaded decompression buffers from
+    // `_buffer_pool`, which can be shared with compressors and other
+    // decompressors so that they stay within its limit together. Files
+    // decompressed concurrently wait for memory when the pool is at its
+    // limit. rapidgzip manages the memory of its chunks itself.
+    void set_buffer_pool(std::shared_ptr<BufferPool> _buffer_pool) {
+	this->buffer_pool = std::move(_buffer_pool);
+    }
+
+    // Load the block and window offsets from an index written with
+    // `set_export_index` when decompressing files. Decompression then
+    // skips searching for the blocks and can seek directly to any offset.
+    void set_import_index(const std::string &_import_index_path) {
+	this->import_index_path = _import_index_path;
+    }
+
+    // Write the index of block and window offsets found while
+    // decompressing a file to `_export_index_path`. The index is only
+    // complete if the whole file was decompressed.
+    void set_export_index(const std::string &_export_index_path) {
+	this->export_index_path = _export_index_path;
+    }
+
+    // Collect the timings and counters that `get_stats` returns. This
+    // also resets the stats collected so far. With rapidgzip only what
+    // tigz measures is counted: the time spent writing and waiting for
+    // the decompressed chunks, not the work of rapidgzip's threads.
+    void set_stats(bool _collect_stats) {
+	std::lock_guard<std::mutex> lock(this->stats_mutex);
+	this->collect_stats = _collect_stats;
+	this->stats = Stats();
+    }
+
+    Stats get_stats() const {
+	std::lock_guard<std::mutex> lock(this->stats_mutex);
+	return this->stats;
+    }
+
+    void decompress_stream(std::istream *in, std::ostream *out) const {
+	Stats run;
+	StatsClock::time_point start = StatsClock::now();
+	this->decompress_with_single_thread(in, out, nullptr, this->stats_for(&run));
+	this->record_run(run, start);
+    }
+
+    // Decompress `in` with a single thread and pass the data to `sink`.
+    // Throws if the data is corrupt.
+    void decompress_stream(std::istream *in, const std::function<void(const char*, size_t)> &sink) const {
+	Stats run;
+	StatsClock::time_point start = StatsClock::now();
+	SinkBuffer sink_buffer(sink);
+	std::ostream out(&sink_buffer);
+	out.exceptions(std::ios::badbit);
+	if (this->decompress_with_single_thread(in, &out, nullptr, this->stats_for(&run)) != Z_OK) {
+	    throw std::runtime_error("decompressing the stream failed.");
+	}
+	this->record_run(run, start);
+    }
+
+    // Decompress `in_path` to `out_path`. Reads from stdin if `in_path`
+    // is empty and writes to stdout if `out_path` is empty.
+    //
+    // Only `length` bytes starting from the uncompressed byte `offset`
+    // are written if these are set. Use with an imported index to
+    // avoid decompressing the data before `offset`.
+    void decompress_file(const std::string &in_path, std::string &out_path,
+			 size_t offset = 0, size_t length = std::numeric_limits<size_t>::max()) const {
+	Stats run;
+	StatsClock::time_point start = StatsClock::now();
+	this->decompress_one_file(in_path, out_path, offset, length, this->stats_for(&run));
+	this->record_run(run, start);
+    }
+
+    // Decompress `in_path`, or stdin if it is empty, and pass the data
+    // to `sink` in order on the calling thread. With many threads `sink`
+    // gets the decompressed chunks as soon as rapidgzip has them, so the
+    // data can be processed (e.g. compressed again) while the rest of
+    // the file is still being decompressed. Throws if the data is corrupt.
+    void decompress_file(const std::string &in_path, const std::function<void(const char*, size_t)> &sink) const {
+	Stats run;
+	StatsClock::time_point start = StatsClock::now();
+	Stats *stats = this->stats_for(&run);
+	if (!this->uses_rapidgzip()) {
+	    SinkBuffer sink_buffer(sink);
+	    std::ostream out(&sink_buffer);
+	    // Let errors from `sink` through instead of only setting badbit
+	    out.exceptions(std::ios::badbit);
+	    int ret = (in_path.empty() ? this->decompress_with_single_thread(&std::cin, &out, nullptr, stats)
+				       : this->decompress_file_with_single_thread(in_path, &out, nullptr, stats));
+	    if (ret != Z_OK) {
+		throw std::runtime_error("decompressing " + (in_path.empty() ? std::string("stdin") : in_path) + " failed.");
+	    }
+	} else {
+	    auto inputFile = this->open_input(in_path);
+	    if (stats != nullptr && !in_path.empty()) {
+		stats->in_nbytes += std::filesystem::file_size(in_path);
+	    }
+	    this->decompress_with_many_threads_to(inputFile, sink, stats);
+	}
+	this->record_run(run, start);
+    }
+
+    // Decompress `in_path` and append the data to `out`, which grows as
+    // needed.
+    void decompress_file(const std::string &in_path, std::vector<char> &out) const {
+	this->decompress_file(in_path, append_to(out));
+    }
+
+    // Decompress `in_path` to the `out_capacity` bytes at `out` and
+    // return the decompressed size. Throws std::length_error if the data
+    // does not fit; `out` then holds the data up to the chunk that
+    // did not fit.
+    size_t decompress_file(const std::string &in_path, char *out, size_t out_capacity) const {
+	size_t out_nbytes = 0;
+	this->decompress_file(in_path, copy_to(out, out_capacity, out_nbytes));
+	return out_nbytes;
+    }
+
+    // Decompress the `in_nbytes` bytes at `in` and pass the data to
+    // `sink` in order on the calling thread, like `decompress_file`.
+    // With many threads rapidgzip reads `in` in place and `sink` gets
+    // pointers into its chunks, so nothing is copied on the way; `in`
+    // must stay valid until this returns. Throws if the data is corrupt.
+    void decompress_buffer(const void *in, size_t in_nbytes, const std::function<void(const char*, size_t)> &sink) const {
+	Stats run;
+	StatsClock::time_point start = StatsClock::now();
+	Stats *stats = this->stats_for(&run);
+	if (!this->uses_rapidgzip()) {
+	    SinkBuffer sink_buffer(sink);
+	    std::ostream out(&sink_buffer);
+	    out.exceptions(std::ios::badbit);
+	    if (this->decompress_memory_with_single_thread(static_cast<const char*>(in), in_nbytes, &out, nullptr, stats) != Z_OK) {
+		throw std::runtime_error("decompressing the buffer failed.");
+	    }
+	} else {
+	    UniqueFileReader inputFile = std::make_unique<BufferViewFileReader>(in, in_nbytes);
+	    if (stats != nullptr) {
+		stats->in_nbytes += in_nbytes;
+	    }
+	    this->decompress_with_many_threads_to(inputFile, sink, stats);
+	}
+	this->record_run(run, start);
+    }
+
+    // Decompress the `in_nbytes` bytes at `in` and append the data to
+    // `out`, which grows as needed.
+    void decompress_buffer(const void *in, size_t in_nbytes, std::vector<char> &out) const {
+	this->decompress_buffer(in, in_nbytes, append_to(out));
+    }
+
+    // Decompress the `in_nbytes` bytes at `in` to the `out_capacity`
+    // bytes at `out` and return the decompressed size. Throws
+    // std::length_error if the data does not fit.
+    size_t decompress_buffer(const void *in, size_t in_nbytes, char *out, size_t out_capacity) const {
+	size_t out_nbytes = 0;
+	this->decompress_buffer(in, in_nbytes, copy_to(out, out_capacity, out_nbytes));
+	return out_nbytes;
+    }
+
+    // Decompress each file in `in_paths` to the same index in
+    // `out_paths`. Files that are too small for rapidgzip to split
+    // across the threads are decompressed concurrently on a pool, one
+    // file per thread and the largest first so that the threads finish
+    // at about the same time. Larger files are decompressed one after
+    // another with rapidgzip while the pool runs. The threads are split
+    // between the two by the total size of their files. zlib and raw
+    // deflate files all go to the pool. If any output is stdout, the
+    // files are decompressed in order with `decompress_file` instead.
+    void decompress_files(const std::vector<std::string> &in_paths, std::vector<std::string> &out_paths) const {
+	if (in_paths.size() != out_paths.size()) {
+	    throw std::invalid_argument("the number of input and output paths must match.");
+	}
+	Stats run;
+	StatsClock::time_point start = StatsClock::now();
+	bool to_stdout = std::any_of(out_paths.begin(), out_paths.end(), [](const std::string &path) { return path.empty(); });
+	if (to_stdout || in_paths.size() == 1) {
+	    for (size_t i = 0; i < in_paths.size(); ++i) {
+		this->decompress_one_file(in_paths[i], out_paths[i], 0, std::numeric_limits<size_t>::max(), this->stats_for(&run));
+	    }
+	    this->record_run(run, start);
+	    return;
+	}
+
+	size_t n_threads_total = this->thread_count();
+	size_t small_file_nbytes = n_threads_total*this->io_buffer_size;
+
+	std::vector<std::pair<size_t, size_t>> small_files; // (size, index in `in_paths`)
+	std::vector<size_t> large_files;
+	size_t small_nbytes = 0;
+	size_t large_nbytes = 0;
+	for (size_t i = 0; i < in_paths.size(); ++i) {
+	    size_t nbytes = std::filesystem::file_size(in_paths[i]);
+	    if ((nbytes < small_file_nbytes || this->format != Format::gzip) && n_threads_total > 1) {
+		small_files.emplace_back(nbytes, i);
+		small_nbytes += nbytes;
+	    } else {
+		large_files.push_back(i);
+		large_nbytes += nbytes;
+	    }
+	}
+	std::sort(small_files.rbegin(), small_files.rend());
+
+	// Threads for the pool in proportion to the bytes of the small
+	// files, leaving at least one for rapidgzip if there are large ones
+	size_t n_pool_threads = n_threads_total;
+	if (!large_files.empty()) {
+	    double share = (double)small_nbytes/std::max(small_nbytes + large_nbytes, (size_t)1);
+	    n_pool_threads = std::min(std::max((size_t)std::lround(share*n_threads_total), (size_t)1), n_threads_total - 1);
+	}
+
+	// Each file collects its own stats since they run concurrently
+	std::vector<Stats> file_stats(small_files.size());
+	StatsClock::time_point pool_start = StatsClock::now();
+	ScopedThreadCpus on_cpus(this->cpus);
+	BS::thread_pool pool(small_files.empty() ? 1 : n_pool_threads);
+	std::vector<std::future<void>> results;
+	for (size_t j = 0; j < small_files.size(); ++j) {
+	    size_t i = small_files[j].second;
+	    Stats *stats = this->stats_for(&file_stats[j]);
+	    results.emplace_back(pool.submit([this, &in_paths, &out_paths, i, stats]() {
+		this->decompress_file_to(in_paths[i], out_paths[i], stats);
+	    }));
+	}
+
+	// The pool waits for its files before an error is passed on
+	for (size_t i : large_files) {
+	    this->decompress_one_file(in_paths[i], out_paths[i], 0, std::numeric_limits<size_t>::max(), this->stats_for(&run),
+				      n_threads_total - (small_files.empty() ? 0 : n_pool_threads));
+	}
+	for (std::future<void> &result : results) {
+	    result.get();
+	}
+	if (!small_files.empty()) {
+	    this->record_pool_run(run, file_stats, n_pool_threads, pool_start);
+	}
+	this->record_run(run, start);
+    }
+
+    // Decompress `in_path` (stdin if empty) without writing the output
+    // and check the crc32 and size of every member. With many threads
+    // the file is decoded in parallel with rapidgzip; since rapidgzip
+    // does not tell where the data went wrong, a failed file is scanned
+    // again member by member to find the first corrupt one.
+    TestResult test_file(const std::string &in_path) const {
+	Stats run;
+	StatsClock::time_point start = StatsClock::now();
+	TestResult result = this->test_one_file(in_path, this->stats_for(&run));
+	this->record_run(run, start);
+	return result;
+    }
+
+    // Test each file in `in_paths` with `test_file`. Small files are
+    // tested concurrently one per thread like in `decompress_files`.
+    std::vector<TestResult> test_files(const std::vector<std::string> &in_paths) const {
+	Stats run;
+	StatsClock::time_point start = StatsClock::now();
+	std::vector<TestResult> results(in_paths.size());
+	size_t n_pool_threads = this->thread_count();
+	size_t small_file_nbytes = n_pool_threads*this->io_buffer_size;
+
+	std::vector<Stats> file_stats(in_paths.size());
+	StatsClock::time_point pool_start = StatsClock::now();
+	ScopedThreadCpus on_cpus(this->cpus);
+	BS::thread_pool pool(n_pool_threads);
+	std::vector<std::pair<size_t, std::future<TestResult>>> small_files;
+	for (size_t i = 0; i < in_paths.size(); ++i) {
+	    if (n_pool_threads > 1 && !in_paths[i].empty() &&
+		(std::filesystem::file_size(in_paths[i]) < small_file_nbytes || this->format != Format::gzip)) {
+		Stats *stats = this->stats_for(&file_stats[i]);
+		small_files.emplace_back(i, pool.submit([this, &in_paths, i, stats]() {
+		    return this->test_with_single_thread(in_paths[i], stats);
+		}));
+	    } else {
+		results[i] = this->test_one_file(in_paths[i], this->stats_for(&run));
+	    }
+	}
+
+	for (auto &file : small_files) {
+	    results[file.first] = file.second.get();
+	}
+	this->record_pool_run(run, file_stats, n_pool_threads, pool_start);
+	this->record_run(run, start);
+	return results;
+    }
 };
 }
 
@@ -0,0 +1,54 @@
+// BSD 3-Clause License
+//
+// Copyright (c) 2023, Tommi Mäklin
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from
+//    this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+#ifndef TIGZ_TIGZ_FORMAT_HPP
+#define TIGZ_TIGZ_FORMAT_HPP
+
+#include <string>
+#include <stdexcept>
+
+namespace tigz {
+// Container of the deflate streams: gzip (RFC 1952), zlib (RFC 1950),
+// or raw deflate (RFC 1951) with no header or checksum
+enum class Format { gzip, zlib, deflate };
+
+inline Format parse_format(const std::string &name) {
+    if (name == "gzip") {
+	return Format::gzip;
+    } else if (name == "zlib") {
+	return Format::zlib;
+    } else if (name == "deflate") {
+	return Format::deflate;
+    }
+    throw std::invalid_argument("unknown format `" + name + "`.");
+}
+}
+
+#endif
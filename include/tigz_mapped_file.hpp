@@ -0,0 +1,96 @@
+// BSD 3-Clause License
+//
+// Copyright (c) 2023, Tommi Mäklin
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from
+//    this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+#ifndef TIGZ_TIGZ_MAPPED_FILE_HPP
+#define TIGZ_TIGZ_MAPPED_FILE_HPP
+
+#include <cstddef>
+#include <string>
+#include <memory>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace tigz {
+// Read-only memory mapping of a regular file
+class MappedFile {
+public:
+    const char *data = nullptr;
+    size_t nbytes = 0;
+
+    MappedFile(const char *_data, size_t _nbytes) : data(_data), nbytes(_nbytes) {}
+    ~MappedFile() {
+	munmap(const_cast<char*>(this->data), this->nbytes);
+    }
+
+    // Delete copy constructor & copy assignment operator
+    MappedFile(const MappedFile& other) = delete;
+    MappedFile& operator=(const MappedFile& other) = delete;
+
+    // Map `path` for sequential reading. Returns nullptr if `path` is
+    // not a non-empty regular file or can't be mapped, so that the
+    // caller can fall back to reading it as a stream.
+    static std::shared_ptr<const MappedFile> map(const std::string &path) {
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0) {
+	    return nullptr;
+	}
+	std::shared_ptr<const MappedFile> mapped = map(fd);
+	close(fd); // The mapping keeps the file open
+	return mapped;
+    }
+
+    // Map the whole file open in `fd` like `map(path)`. `fd` stays open.
+    static std::shared_ptr<const MappedFile> map(int fd) {
+	struct stat file_stat;
+	if (fstat(fd, &file_stat) != 0 || !S_ISREG(file_stat.st_mode) || file_stat.st_size == 0) {
+	    return nullptr;
+	}
+	size_t nbytes = file_stat.st_size;
+	void *data = mmap(nullptr, nbytes, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED) {
+	    return nullptr;
+	}
+	madvise(data, nbytes, MADV_SEQUENTIAL);
+	return std::make_shared<const MappedFile>(static_cast<const char*>(data), nbytes);
+    }
+
+    // Start reading the pages in [offset, offset + length) into memory
+    void will_need(size_t offset, size_t length) const {
+	static const size_t page_size = sysconf(_SC_PAGESIZE);
+	size_t aligned_offset = offset - offset % page_size;
+	madvise(const_cast<char*>(this->data) + aligned_offset, length + offset - aligned_offset, MADV_WILLNEED);
+    }
+};
+}
+
+#endif
@@ -0,0 +1,405 @@
+// BSD 3-Clause License
+//
+// Copyright (c) 2023, Tommi Mäklin
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from
+//    this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+#ifndef TIGZ_TIGZ_OUTPUT_WRITER_HPP
+#define TIGZ_TIGZ_OUTPUT_WRITER_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <cerrno>
+#include <string>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <system_error>
+#include <atomic>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <linux/io_uring.h>
+
+#include "tigz_buffer_pool.hpp"
+
+namespace tigz {
+// Minimal io_uring with a single writev in flight, set up with the raw
+// system calls. `create` returns nullptr if the kernel does not allow
+// io_uring (too old, or blocked by seccomp in containers).
+class IoUring {
+private:
+    int ring_fd = -1;
+    void *sq_ring = MAP_FAILED;
+    void *cq_ring = MAP_FAILED;
+    size_t sq_ring_nbytes = 0;
+    size_t cq_ring_nbytes = 0;
+    io_uring_sqe *sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+    size_t sqes_nbytes = 0;
+
+    unsigned *sq_tail = nullptr;
+    unsigned *sq_mask = nullptr;
+    unsigned *sq_array = nullptr;
+    unsigned *cq_head = nullptr;
+    unsigned *cq_tail = nullptr;
+    unsigned *cq_mask = nullptr;
+    io_uring_cqe *cqes = nullptr;
+
+    IoUring() = default;
+
+    static char* at(void *ring, size_t offset) {
+	return static_cast<char*>(ring) + offset;
+    }
+
+public:
+    ~IoUring() {
+	if (this->sqes != MAP_FAILED) {
+	    munmap(this->sqes, this->sqes_nbytes);
+	}
+	if (this->cq_ring != MAP_FAILED) {
+	    munmap(this->cq_ring, this->cq_ring_nbytes);
+	}
+	if (this->sq_ring != MAP_FAILED) {
+	    munmap(this->sq_ring, this->sq_ring_nbytes);
+	}
+	if (this->ring_fd >= 0) {
+	    close(this->ring_fd);
+	}
+    }
+
+    // Delete copy constructor & copy assignment operator
+    IoUring(const IoUring& other) = delete;
+    IoUring& operator=(const IoUring& other) = delete;
+
+    static std::unique_ptr<IoUring> create() {
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+	std::unique_ptr<IoUring> ring(new IoUring());
+	io_uring_params params = {};
+	ring->ring_fd = syscall(__NR_io_uring_setup, 4, &params);
+	if (ring->ring_fd < 0) {
+	    return nullptr;
+	}
+
+	ring->sq_ring_nbytes = params.sq_off.array + params.sq_entries*sizeof(unsigned);
+	ring->cq_ring_nbytes = params.cq_off.cqes + params.cq_entries*sizeof(io_uring_cqe);
+	ring->sqes_nbytes = params.sq_entries*sizeof(io_uring_sqe);
+	ring->sq_ring = mmap(nullptr, ring->sq_ring_nbytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQ_RING);
+	ring->cq_ring = mmap(nullptr, ring->cq_ring_nbytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_CQ_RING);
+	void *sqes = mmap(nullptr, ring->sqes_nbytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQES);
+	ring->sqes = static_cast<io_uring_sqe*>(sqes);
+	if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || sqes == MAP_FAILED) {
+	    return nullptr;
+	}
+
+	ring->sq_tail = reinterpret_cast<unsigned*>(at(ring->sq_ring, params.sq_off.tail));
+	ring->sq_mask = reinterpret_cast<unsigned*>(at(ring->sq_ring, params.sq_off.ring_mask));
+	ring->sq_array = reinterpret_cast<unsigned*>(at(ring->sq_ring, params.sq_off.array));
+	ring->cq_head = reinterpret_cast<unsigned*>(at(ring->cq_ring, params.cq_off.head));
+	ring->cq_tail = reinterpret_cast<unsigned*>(at(ring->cq_ring, params.cq_off.tail));
+	ring->cq_mask = reinterpret_cast<unsigned*>(at(ring->cq_ring, params.cq_off.ring_mask));
+	ring->cqes = reinterpret_cast<io_uring_cqe*>(at(ring->cq_ring, params.cq_off.cqes));
+	return ring;
+#else
+	return nullptr;
+#endif
+    }
+
+    // Queue a positioned writev of `iov` and submit it without waiting.
+    // Returns false if the submission failed.
+    bool submit_writev(int fd, const iovec *iov, size_t n_iov, uint64_t offset) {
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+	unsigned tail = *this->sq_tail;
+	unsigned index = tail & *this->sq_mask;
+	io_uring_sqe *sqe = &this->sqes[index];
+	*sqe = {};
+	sqe->opcode = IORING_OP_WRITEV;
+	sqe->fd = fd;
+	sqe->addr = reinterpret_cast<uint64_t>(iov);
+	sqe->len = n_iov;
+	sqe->off = offset;
+	this->sq_array[index] = index;
+	__atomic_store_n(this->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	return syscall(__NR_io_uring_enter, this->ring_fd, 1, 0, 0, nullptr, 0) == 1;
+#else
+	return false;
+#endif
+    }
+
+    // Wait for the write in flight and return its result: the number of
+    // bytes written or -errno.
+    int wait_result() {
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+	unsigned head = *this->cq_head;
+	while (head == __atomic_load_n(this->cq_tail, __ATOMIC_ACQUIRE)) {
+	    if (syscall(__NR_io_uring_enter, this->ring_fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0) < 0 && errno != EINTR) {
+		return -errno;
+	    }
+	}
+	int result = this->cqes[head & *this->cq_mask].res;
+	__atomic_store_n(this->cq_head, head + 1, __ATOMIC_RELEASE);
+	return result;
+#else
+	return -ENOSYS;
+#endif
+    }
+};
+
+// Writes compressed output to a file or stdout without iostream
+// buffering. Output is passed in as batches of buffers that are
+// written with a single writev. Batches for regular files go through
+// io_uring when available and stay in flight while the caller goes on;
+// otherwise they are written with pwritev/writev before `submit`
+// returns. With `direct` a regular file is opened with O_DIRECT and
+// written from an aligned staging buffer, bypassing the page cache.
+class OutputWriter {
+private:
+    int fd = -1;
+    bool close_fd = false;
+
+    // Regular files are written at `offset` with positioned writes
+    bool positioned = false;
+    uint64_t offset = 0;
+
+    // Batch in flight in `ring` and the copy of its iovecs
+    std::unique_ptr<IoUring> ring;
+    std::vector<iovec> in_flight_iov;
+    size_t in_flight_nbytes = 0;
+    bool busy = false;
+
+    // O_DIRECT staging buffer; the part up to `staged_nbytes` is unwritten
+    bool direct = false;
+    std::shared_ptr<BufferPool> staging_pool;
+    Buffer staging;
+    size_t staged_nbytes = 0;
+    static constexpr size_t staging_nbytes = 4194304;
+    static constexpr size_t direct_alignment = 4096;
+
+    [[noreturn]] static void throw_errno(const std::string &what) {
+	throw std::system_error(errno, std::generic_category(), what);
+    }
+
+    // Write all of `iov` starting from `skip_nbytes` into it
+    void write_all(const iovec *iov, size_t n_iov, size_t skip_nbytes) {
+	std::vector<iovec> rest(iov, iov + n_iov);
+	size_t first = 0;
+	while (first < rest.size()) {
+	    // Drop what was already written
+	    while (first < rest.size() && skip_nbytes >= rest[first].iov_len) {
+		skip_nbytes -= rest[first].iov_len;
+		++first;
+	    }
+	    if (first == rest.size()) {
+		break;
+	    }
+	    rest[first].iov_base = static_cast<char*>(rest[first].iov_base) + skip_nbytes;
+	    rest[first].iov_len -= skip_nbytes;
+
+	    int n = std::min(rest.size() - first, (size_t)IOV_MAX);
+	    ssize_t written = (this->positioned ? pwritev(this->fd, rest.data() + first, n, this->offset)
+						: writev(this->fd, rest.data() + first, n));
+	    if (written < 0 && errno == EINTR) {
+		skip_nbytes = 0;
+		continue;
+	    } else if (written < 0) {
+		throw_errno("writing the output failed");
+	    }
+	    if (this->positioned) {
+		this->offset += written;
+	    }
+	    skip_nbytes = written;
+	}
+    }
+
+    // Write `nbytes` from the start of the staging buffer with O_DIRECT
+    void write_staged(size_t nbytes) {
+	iovec iov = { this->staging.data(), nbytes };
+	this->write_all(&iov, 1, 0);
+	std::copy(this->staging.data() + nbytes, this->staging.data() + this->staged_nbytes, this->staging.data());
+	this->staged_nbytes -= nbytes;
+    }
+
+    void append_staged(const iovec *iov, size_t n_iov) {
+	for (size_t i = 0; i < n_iov; ++i) {
+	    const char *data = static_cast<const char*>(iov[i].iov_base);
+	    size_t nbytes = iov[i].iov_len;
+	    while (nbytes > 0) {
+		size_t len = std::min(nbytes, this->staging.size() - this->staged_nbytes);
+		std::copy(data, data + len, this->staging.data() + this->staged_nbytes);
+		this->staged_nbytes += len;
+		data += len;
+		nbytes -= len;
+		if (this->staged_nbytes == this->staging.size()) {
+		    this->write_staged(this->staged_nbytes);
+		}
+	    }
+	}
+    }
+
+public:
+    // Open `path` for writing, truncating it, or write to stdout if
+    // `path` is empty. O_DIRECT is only used if the file system allows it.
+    OutputWriter(const std::string &path, bool _direct = false) {
+	if (path.empty()) {
+	    this->fd = STDOUT_FILENO;
+	} else {
+	    int flags = O_WRONLY | O_CREAT | O_TRUNC;
+	    if (_direct) {
+		this->fd = open(path.c_str(), flags | O_DIRECT, 0644);
+		this->direct = (this->fd >= 0);
+	    }
+	    if (this->fd < 0) {
+		this->fd = open(path.c_str(), flags, 0644);
+	    }
+	    if (this->fd < 0) {
+		throw_errno("can't open " + path + " for writing");
+	    }
+	    this->close_fd = true;
+	}
+
+	struct stat file_stat;
+	if (fstat(this->fd, &file_stat) == 0 && S_ISREG(file_stat.st_mode)) {
+	    off_t position = lseek(this->fd, 0, SEEK_CUR);
+	    this->positioned = (position >= 0);
+	    this->offset = (position >= 0 ? position : 0);
+	}
+	if (this->direct) {
+	    this->staging_pool = std::make_shared<BufferPool>();
+	    this->staging = this->staging_pool->acquire(staging_nbytes);
+	} else if (this->positioned) {
+	    this->ring = IoUring::create();
+	}
+    }
+
+    // Write to `_fd`, which the caller opened and keeps open. Writes go
+    // out before `write` returns, so no io_uring is set up for them.
+    explicit OutputWriter(int _fd) : fd(_fd) {
+	struct stat file_stat;
+	if (fstat(this->fd, &file_stat) == 0 && S_ISREG(file_stat.st_mode)) {
+	    off_t position = lseek(this->fd, 0, SEEK_CUR);
+	    this->positioned = (position >= 0);
+	    this->offset = (position >= 0 ? position : 0);
+	}
+    }
+
+    ~OutputWriter() {
+	try {
+	    this->close();
+	} catch (...) {
+	    // The caller has already failed if it did not close the writer
+	}
+    }
+
+    // Delete copy constructor & copy assignment operator
+    OutputWriter(const OutputWriter& other) = delete;
+    OutputWriter& operator=(const OutputWriter& other) = delete;
+
+    // Write the `n_iov` buffers in `iov`. The buffers must stay valid
+    // until `wait` (or the next `submit`, `write`, or `close`) returns.
+    void submit(const iovec *iov, size_t n_iov) {
+	this->wait();
+	if (this->direct) {
+	    this->append_staged(iov, n_iov);
+	    return;
+	}
+	if (this->ring != nullptr && n_iov <= IOV_MAX) {
+	    this->in_flight_iov.assign(iov, iov + n_iov);
+	    this->in_flight_nbytes = 0;
+	    for (size_t i = 0; i < n_iov; ++i) {
+		this->in_flight_nbytes += iov[i].iov_len;
+	    }
+	    if (this->ring->submit_writev(this->fd, this->in_flight_iov.data(), n_iov, this->offset)) {
+		this->busy = true;
+		return;
+	    }
+	    // Fall back to plain writes for the rest of the file
+	    this->ring.reset();
+	}
+	this->write_all(iov, n_iov, 0);
+    }
+
+    // Wait until the batch in flight has been written
+    void wait() {
+	if (!this->busy) {
+	    return;
+	}
+	this->busy = false;
+	int result = this->ring->wait_result();
+	if (result < 0) {
+	    errno = -result;
+	    throw_errno("writing the output failed");
+	}
+	this->offset += result;
+	if ((size_t)result < this->in_flight_nbytes) {
+	    // Short write, e.g. interrupted by a signal
+	    this->write_all(this->in_flight_iov.data(), this->in_flight_iov.size(), result);
+	}
+    }
+
+    // Write `nbytes` from `data` before returning
+    void write(const char *data, size_t nbytes) {
+	iovec iov = { const_cast<char*>(data), nbytes };
+	this->submit(&iov, 1);
+	this->wait();
+    }
+
+    // Write out everything and close the file. stdout is left open.
+    void close() {
+	if (this->fd < 0) {
+	    return;
+	}
+	this->wait();
+	if (this->direct && this->staged_nbytes > 0) {
+	    // The unaligned tail is written without O_DIRECT
+	    size_t aligned_nbytes = this->staged_nbytes/direct_alignment*direct_alignment;
+	    if (aligned_nbytes > 0) {
+		this->write_staged(aligned_nbytes);
+	    }
+	    if (this->staged_nbytes > 0) {
+		fcntl(this->fd, F_SETFL, fcntl(this->fd, F_GETFL) & ~O_DIRECT);
+		this->write_staged(this->staged_nbytes);
+	    }
+	}
+	if (this->positioned) {
+	    // Positioned writes don't move the file position shared with
+	    // other processes writing to the same stdout
+	    lseek(this->fd, this->offset, SEEK_SET);
+	}
+	int fd_to_close = this->fd;
+	this->fd = -1;
+	if (this->close_fd && ::close(fd_to_close) != 0) {
+	    throw_errno("closing the output failed");
+	}
+    }
+};
+}
+
+#endif
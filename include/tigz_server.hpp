@@ -0,0 +1,654 @@
+// BSD 3-Clause License
+//
+// Copyright (c) 2023, Tommi Mäklin
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from
+//    this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+#ifndef TIGZ_TIGZ_SERVER_HPP
+#define TIGZ_TIGZ_SERVER_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <cerrno>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <istream>
+#include <streambuf>
+#include <stdexcept>
+#include <system_error>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "BS_thread_pool.hpp"
+
+#include "tigz_compressor.hpp"
+#include "tigz_decompressor.hpp"
+#include "tigz_output_writer.hpp"
+#include "tigz_mapped_file.hpp"
+#include "tigz_buffer_pool.hpp"
+#include "tigz_affinity.hpp"
+#include "tigz_format.hpp"
+
+namespace tigz {
+// Job sent by `run_on_server` over the Unix socket. The input and
+// output descriptors follow as SCM_RIGHTS ancillary data, so the server
+// reads and writes the client's files, pipes, or terminal directly.
+struct ServerRequest {
+    static constexpr uint32_t protocol_version = 1;
+    static constexpr uint8_t compress = 0;
+    static constexpr uint8_t decompress = 1;
+    static constexpr uint8_t dictionary = 1; // `flags`
+    static constexpr uint8_t bgzf = 2;       // `flags`
+
+    uint32_t version = protocol_version;
+    uint8_t mode = compress;
+    uint8_t level = 6;
+    uint8_t format = static_cast<uint8_t>(Format::gzip);
+    uint8_t flags = 0;
+};
+
+// Sent back when the job is done, followed by `message_nbytes` of the
+// error message if `status` is not 0
+struct ServerReply {
+    int32_t status = 0;
+    uint32_t message_nbytes = 0;
+};
+
+namespace detail {
+[[noreturn]] inline void throw_errno(const std::string &what) {
+    throw std::system_error(errno, std::generic_category(), what);
+}
+
+inline sockaddr_un socket_address(const std::string &socket_path) {
+    sockaddr_un address;
+    std::memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (socket_path.empty() || socket_path.size() >= sizeof(address.sun_path)) {
+	throw std::invalid_argument("the socket path must be 1 to " + std::to_string(sizeof(address.sun_path) - 1) + " characters.");
+    }
+    std::copy(socket_path.begin(), socket_path.end(), address.sun_path);
+    return address;
+}
+
+// Connect to the server at `socket_path`, returns -1 with errno set if
+// nothing listens there
+inline int connect_to(const std::string &socket_path) {
+    sockaddr_un address = socket_address(socket_path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+	throw_errno("can't create a socket");
+    }
+    if (connect(fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0) {
+	int connect_errno = errno;
+	close(fd);
+	errno = connect_errno;
+	return -1;
+    }
+    return fd;
+}
+
+inline void send_all(int fd, const void *data, size_t nbytes) {
+    const char *src = static_cast<const char*>(data);
+    while (nbytes > 0) {
+	ssize_t sent = send(fd, src, nbytes, MSG_NOSIGNAL);
+	if (sent < 0 && errno == EINTR) {
+	    continue;
+	} else if (sent < 0) {
+	    throw_errno("sending to the tigz server failed");
+	}
+	src += sent;
+	nbytes -= sent;
+    }
+}
+
+// Receive exactly `nbytes`, returns false if the peer closed first
+inline bool receive_all(int fd, void *data, size_t nbytes) {
+    char *dest = static_cast<char*>(data);
+    while (nbytes > 0) {
+	ssize_t received = recv(fd, dest, nbytes, 0);
+	if (received < 0 && errno == EINTR) {
+	    continue;
+	} else if (received < 0) {
+	    throw_errno("receiving from the tigz server failed");
+	} else if (received == 0) {
+	    return false;
+	}
+	dest += received;
+	nbytes -= received;
+    }
+    return true;
+}
+
+// Stream buffer that reads from a descriptor, for inputs that can't be
+// mapped
+class DescriptorBuffer : public std::streambuf {
+private:
+    int fd;
+    Buffer buffer;
+
+protected:
+    int_type underflow() override {
+	ssize_t nbytes;
+	do {
+	    nbytes = read(this->fd, this->buffer.data(), this->buffer.size());
+	} while (nbytes < 0 && errno == EINTR);
+	if (nbytes <= 0) {
+	    return traits_type::eof();
+	}
+	this->setg(this->buffer.data(), this->buffer.data(), this->buffer.data() + nbytes);
+	return traits_type::to_int_type(*this->gptr());
+    }
+
+public:
+    DescriptorBuffer(int _fd, Buffer &&_buffer) : fd(_fd), buffer(std::move(_buffer)) {}
+};
+}
+
+// Persistent compression server. It listens on a Unix socket and runs
+// the jobs sent with `run_on_server` on the descriptors passed with
+// them, so a program that compresses many small files pays for the
+// thread pools and the libdeflate compressors once instead of on every
+// run. Up to `n_lanes` jobs run at once, each on a lane with its own
+// single-threaded compressors (one per level used) and decompressor,
+// so a job's latency depends on its size rather than on setup. Input
+// files of at least `large_input_nbytes` instead use the shared
+// multithreaded compressors and decompressor if no other large job
+// holds them; inputs of unknown size (pipes) always stay on the lane.
+//
+// A job holds its lane until it is done, so slow clients (e.g. one
+// that reads its output slowly) take lanes from others. Clients that
+// connect but don't send a job within `handshake_timeout` are dropped,
+// and at most `pending_per_lane` connections per lane are accepted;
+// the rest wait in the socket's backlog.
+//
+// Writing to a closed pipe raises SIGPIPE, which the caller should
+// ignore so that a client going away fails only its own job.
+class Server {
+private:
+    struct Lane {
+	std::map<size_t, std::unique_ptr<ParallelCompressor>> compressors;
+	std::unique_ptr<ParallelDecompressor> decompressor;
+    };
+
+    std::string socket_path;
+    size_t block_size;
+    std::shared_ptr<BufferPool> buffer_pool;
+
+    // Lanes that no job is running on
+    std::vector<std::unique_ptr<Lane>> lanes;
+    std::vector<Lane*> free_lanes;
+    std::mutex lanes_mutex;
+    std::condition_variable lane_returned;
+
+    // Multithreaded engines for large inputs, used by one job at a time
+    Lane shared;
+    std::mutex shared_mutex;
+    size_t n_shared_threads;
+    size_t large_input_nbytes = 8388608;
+
+    int listen_fd = -1;
+    std::atomic<bool> stopping{false};
+
+    static constexpr std::chrono::seconds handshake_timeout{5};
+    static constexpr size_t pending_per_lane = 4;
+
+    // Connections accepted and not yet answered
+    size_t n_pending = 0;
+    std::mutex pending_mutex;
+    std::condition_variable connection_done;
+
+    size_t max_pending() const {
+	return pending_per_lane*this->lanes.size();
+    }
+
+    void finish_connection() {
+	{
+	    std::lock_guard<std::mutex> lock(this->pending_mutex);
+	    --this->n_pending;
+	}
+	this->connection_done.notify_one();
+    }
+
+    // One thread per lane, so a task always finds a free lane
+    BS::thread_pool pool;
+
+    // Warm compressor of `lane` for `level` with `n_threads`, created on
+    // first use
+    ParallelCompressor& compressor(Lane &lane, size_t level, size_t n_threads = 1) {
+	std::unique_ptr<ParallelCompressor> &cmp = lane.compressors[level];
+	if (cmp == nullptr) {
+	    cmp = std::make_unique<ParallelCompressor>(n_threads, level, this->block_size, this->block_size);
+	    cmp->set_buffer_pool(this->buffer_pool);
+	}
+	return *cmp;
+    }
+
+    ParallelDecompressor& decompressor(Lane &lane, size_t n_threads = 1) {
+	if (lane.decompressor == nullptr) {
+	    lane.decompressor = std::make_unique<ParallelDecompressor>(n_threads, this->block_size);
+	    lane.decompressor->set_buffer_pool(this->buffer_pool);
+	}
+	return *lane.decompressor;
+    }
+
+    void compress(ParallelCompressor &cmp, const ServerRequest &request, int in_fd, const std::shared_ptr<const MappedFile> &mapped, OutputWriter &out) {
+	cmp.set_format(static_cast<Format>(request.format));
+	cmp.set_dictionary((request.flags & ServerRequest::dictionary) != 0);
+	cmp.set_bgzf((request.flags & ServerRequest::bgzf) != 0);
+	cmp.open([&out](const char *data, size_t nbytes) { out.write(data, nbytes); });
+
+	try {
+	    if (mapped != nullptr) {
+		cmp.write(mapped->data, mapped->nbytes);
+	    } else {
+		Buffer buffer = this->buffer_pool->acquire(this->block_size);
+		while (true) {
+		    ssize_t nbytes = read(in_fd, buffer.data(), buffer.size());
+		    if (nbytes < 0 && errno == EINTR) {
+			continue;
+		    } else if (nbytes < 0) {
+			detail::throw_errno("reading the input failed");
+		    } else if (nbytes == 0) {
+			break;
+		    }
+		    cmp.write(buffer.data(), nbytes);
+		}
+	    }
+	    cmp.finish();
+	} catch (...) {
+	    // Keep the lane's compressor usable for the next job
+	    cmp.abort();
+	    throw;
+	}
+    }
+
+    void decompress(ParallelDecompressor &decomp, const ServerRequest &request, int in_fd, const std::shared_ptr<const MappedFile> &mapped, OutputWriter &out) {
+	decomp.set_format(static_cast<Format>(request.format));
+	auto sink = [&out](const char *data, size_t nbytes) { out.write(data, nbytes); };
+
+	if (mapped != nullptr) {
+	    decomp.decompress_buffer(mapped->data, mapped->nbytes, sink);
+	} else {
+	    detail::DescriptorBuffer in_buffer(in_fd, this->buffer_pool->acquire(this->block_size));
+	    std::istream in(&in_buffer);
+	    decomp.decompress_stream(&in, sink);
+	}
+    }
+
+    // Receive the request on `connection` and the input and output
+    // descriptors passed with it into `fds`. Returns false if the client
+    // closed the connection without sending a job.
+    bool receive_request(int connection, ServerRequest &request, int *fds) {
+	alignas(cmsghdr) char control[CMSG_SPACE(2*sizeof(int))];
+	iovec iov = { &request, sizeof(request) };
+	msghdr message;
+	std::memset(&message, 0, sizeof(message));
+	message.msg_iov = &iov;
+	message.msg_iovlen = 1;
+	message.msg_control = control;
+	message.msg_controllen = sizeof(control);
+
+	ssize_t received;
+	do {
+	    received = recvmsg(connection, &message, MSG_CMSG_CLOEXEC);
+	} while (received < 0 && errno == EINTR);
+	if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+	    throw std::runtime_error("timed out waiting for the job.");
+	} else if (received < 0) {
+	    detail::throw_errno("receiving the request failed");
+	} else if (received == 0) {
+	    return false;
+	}
+
+	// Keep the first two descriptors, close any others
+	size_t n_fds = 0;
+	for (cmsghdr *cmsg = CMSG_FIRSTHDR(&message); cmsg != nullptr; cmsg = CMSG_NXTHDR(&message, cmsg)) {
+	    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+		continue;
+	    }
+	    size_t n = (cmsg->cmsg_len - CMSG_LEN(0))/sizeof(int);
+	    for (size_t i = 0; i < n; ++i) {
+		int fd;
+		std::memcpy(&fd, CMSG_DATA(cmsg) + i*sizeof(int), sizeof(int));
+		if (n_fds < 2) {
+		    fds[n_fds++] = fd;
+		} else {
+		    close(fd);
+		}
+	    }
+	}
+
+	if ((size_t)received < sizeof(request) &&
+	    !detail::receive_all(connection, reinterpret_cast<char*>(&request) + received, sizeof(request) - received)) {
+	    throw std::invalid_argument("incomplete request.");
+	}
+	if (n_fds != 2 || (message.msg_flags & MSG_CTRUNC) != 0) {
+	    throw std::invalid_argument("a job needs an input and an output descriptor.");
+	}
+	return true;
+    }
+
+    Lane* take_lane() {
+	std::unique_lock<std::mutex> lock(this->lanes_mutex);
+	this->lane_returned.wait(lock, [this]() { return !this->free_lanes.empty(); });
+	Lane *lane = this->free_lanes.back();
+	this->free_lanes.pop_back();
+	return lane;
+    }
+
+    void return_lane(Lane *lane) {
+	{
+	    std::lock_guard<std::mutex> lock(this->lanes_mutex);
+	    this->free_lanes.push_back(lane);
+	}
+	this->lane_returned.notify_one();
+    }
+
+    // Run the job on `lane`, or on the shared engines if the input is
+    // a large file and no other job uses them
+    void run(Lane &lane, const ServerRequest &request, int in_fd, OutputWriter &out) {
+	// A file that is read from the start is mapped, anything else is read
+	std::shared_ptr<const MappedFile> mapped = (lseek(in_fd, 0, SEEK_CUR) == 0 ? MappedFile::map(in_fd) : nullptr);
+	std::unique_lock<std::mutex> shared_lock(this->shared_mutex, std::defer_lock);
+	bool large = (this->n_shared_threads > 1 && mapped != nullptr && mapped->nbytes >= this->large_input_nbytes && shared_lock.try_lock());
+
+	Lane &engines = (large ? this->shared : lane);
+	size_t n_threads = (large ? this->n_shared_threads : 1);
+	if (request.mode == ServerRequest::compress) {
+	    this->compress(this->compressor(engines, request.level, n_threads), request, in_fd, mapped, out);
+	} else {
+	    this->decompress(this->decompressor(engines, n_threads), request, in_fd, mapped, out);
+	}
+    }
+
+    // Receive a job on `connection`, run it on a free lane, and reply
+    void handle(int connection) {
+	ServerRequest request;
+	int fds[2] = { -1, -1 };
+	ServerReply reply;
+	std::string message;
+	try {
+	    if (!this->receive_request(connection, request, fds)) {
+		close(connection);
+		return;
+	    }
+	    if (request.version != ServerRequest::protocol_version) {
+		throw std::invalid_argument("the client and server versions differ.");
+	    }
+	    if (request.mode > ServerRequest::decompress || request.level > 12 ||
+		request.format > static_cast<uint8_t>(Format::deflate)) {
+		throw std::invalid_argument("invalid request.");
+	    }
+
+	    Lane *lane = this->take_lane();
+	    try {
+		OutputWriter out(fds[1]);
+		this->run(*lane, request, fds[0], out);
+		out.close();
+	    } catch (...) {
+		this->return_lane(lane);
+		throw;
+	    }
+	    this->return_lane(lane);
+	} catch (const std::exception &e) {
+	    reply.status = 1;
+	    message = e.what();
+	}
+	for (int fd : fds) {
+	    if (fd >= 0) {
+		close(fd);
+	    }
+	}
+
+	reply.message_nbytes = message.size();
+	try {
+	    detail::send_all(connection, &reply, sizeof(reply));
+	    detail::send_all(connection, message.data(), message.size());
+	} catch (const std::system_error &) {
+	    // The client is gone, nobody to tell
+	}
+	close(connection);
+    }
+
+public:
+    // Prepare `_n_lanes` lanes (one per available CPU if 0) with a warm
+    // level 6 compressor and a decompressor each, and the shared level 6
+    // compressor and decompressor with a thread per available CPU.
+    // Buffers are `_block_size` bytes. The socket is created by `serve`.
+    Server(const std::string &_socket_path, size_t _n_lanes = 0, size_t _block_size = 131072)
+	: pool(_n_lanes > 0 ? _n_lanes : available_cpu_count()) {
+	this->socket_path = _socket_path;
+	this->block_size = _block_size;
+	this->buffer_pool = std::make_shared<BufferPool>();
+	(void)detail::socket_address(this->socket_path); // Check the path early
+
+	size_t n_lanes = this->pool.get_thread_count();
+	for (size_t i = 0; i < n_lanes; ++i) {
+	    this->lanes.emplace_back(std::make_unique<Lane>());
+	    Lane &lane = *this->lanes.back();
+	    this->decompressor(lane);
+	    this->compressor(lane, 6);
+	    this->free_lanes.push_back(&lane);
+	}
+	this->set_large_inputs(available_cpu_count(), this->large_input_nbytes);
+    }
+
+    ~Server() {
+	this->stop();
+	this->pool.wait_for_tasks();
+	if (this->listen_fd >= 0) {
+	    close(this->listen_fd);
+	    unlink(this->socket_path.c_str());
+	}
+    }
+
+    // Delete copy constructor & copy assignment operator
+    Server(const Server& other) = delete;
+    Server& operator=(const Server& other) = delete;
+
+    // Take the buffers of all lanes from `_buffer_pool`, e.g. to limit
+    // the memory of the jobs running at once
+    void set_buffer_pool(std::shared_ptr<BufferPool> _buffer_pool) {
+	this->buffer_pool = std::move(_buffer_pool);
+	std::vector<Lane*> all_lanes = { &this->shared };
+	for (const std::unique_ptr<Lane> &lane : this->lanes) {
+	    all_lanes.push_back(lane.get());
+	}
+	for (Lane *lane : all_lanes) {
+	    if (lane->decompressor != nullptr) {
+		lane->decompressor->set_buffer_pool(this->buffer_pool);
+	    }
+	    for (auto &[level, cmp] : lane->compressors) {
+		cmp->set_buffer_pool(this->buffer_pool);
+	    }
+	}
+    }
+
+    // Run input files of at least `_large_input_nbytes` on the shared
+    // engines with `_n_shared_threads` (all available CPUs if 0), or
+    // keep every job on its lane if `_n_shared_threads` is 1. Call
+    // before `serve`.
+    void set_large_inputs(size_t _n_shared_threads, size_t _large_input_nbytes) {
+	this->n_shared_threads = (_n_shared_threads > 0 ? _n_shared_threads : available_cpu_count());
+	this->large_input_nbytes = _large_input_nbytes;
+	this->shared.compressors.clear();
+	this->shared.decompressor.reset();
+	if (this->n_shared_threads > 1) {
+	    this->decompressor(this->shared, this->n_shared_threads);
+	    this->compressor(this->shared, 6, this->n_shared_threads);
+	}
+    }
+
+    // Run the job sent on `connection`, an already connected socket
+    // (e.g. one end of a socketpair), reply, and close it. Waits for a
+    // free lane; `serve` calls this for each accepted connection.
+    void handle_connection(int connection) {
+	this->handle(connection);
+    }
+
+    // Listen on the socket and run jobs until `stop` is called. A stale
+    // socket left by a server that exited is replaced; throws if another
+    // server is listening on it.
+    void serve() {
+	int running = detail::connect_to(this->socket_path);
+	if (running >= 0) {
+	    close(running);
+	    throw std::runtime_error("a tigz server is already listening on " + this->socket_path + ".");
+	} else if (errno == ECONNREFUSED) {
+	    unlink(this->socket_path.c_str());
+	}
+
+	sockaddr_un address = detail::socket_address(this->socket_path);
+	this->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (this->listen_fd < 0) {
+	    detail::throw_errno("can't create a socket");
+	}
+	if (bind(this->listen_fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0) {
+	    detail::throw_errno("can't bind to " + this->socket_path);
+	}
+	if (listen(this->listen_fd, this->max_pending()) != 0) {
+	    detail::throw_errno("can't listen on " + this->socket_path);
+	}
+
+	while (!this->stopping) {
+	    {
+		// Leave connections over the cap in the backlog. `stop` may
+		// run in a signal handler and can't notify, so poll for it.
+		std::unique_lock<std::mutex> lock(this->pending_mutex);
+		while (this->n_pending >= this->max_pending() && !this->stopping) {
+		    this->connection_done.wait_for(lock, std::chrono::milliseconds(100));
+		}
+	    }
+	    int connection = accept4(this->listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+	    if (connection < 0) {
+		if (errno == EINTR || errno == ECONNABORTED) {
+		    continue;
+		} else if (this->stopping) {
+		    break;
+		}
+		detail::throw_errno("accepting a connection failed");
+	    }
+
+	    // Don't let a client that sends nothing hold a thread
+	    timeval timeout = { (time_t)handshake_timeout.count(), 0 };
+	    setsockopt(connection, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	    {
+		std::lock_guard<std::mutex> lock(this->pending_mutex);
+		++this->n_pending;
+	    }
+	    this->pool.push_task([this, connection]() {
+		this->handle(connection);
+		this->finish_connection();
+	    });
+	}
+	this->pool.wait_for_tasks();
+    }
+
+    // Make `serve` return once the jobs that are running finish. Can be
+    // called from another thread.
+    void stop() {
+	this->stopping = true;
+	if (this->listen_fd >= 0) {
+	    // Wakes up `accept`
+	    shutdown(this->listen_fd, SHUT_RDWR);
+	}
+    }
+};
+
+// Send a job to the server on the connected socket `fd` and wait for
+// the reply, like `run_on_server`. `fd` stays open.
+inline void run_on_connection(int fd, const ServerRequest &request, int in_fd, int out_fd) {
+    iovec iov = { const_cast<ServerRequest*>(&request), sizeof(request) };
+    alignas(cmsghdr) char control[CMSG_SPACE(2*sizeof(int))];
+    std::memset(control, 0, sizeof(control));
+    msghdr message;
+    std::memset(&message, 0, sizeof(message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(2*sizeof(int));
+    int fds[2] = { in_fd, out_fd };
+    std::memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    ssize_t sent;
+    do {
+	sent = sendmsg(fd, &message, MSG_NOSIGNAL);
+    } while (sent < 0 && errno == EINTR);
+    if (sent < 0) {
+	detail::throw_errno("sending the job to the tigz server failed");
+    } else if ((size_t)sent < sizeof(request)) {
+	detail::send_all(fd, reinterpret_cast<const char*>(&request) + sent, sizeof(request) - sent);
+    }
+
+    ServerReply reply;
+    if (!detail::receive_all(fd, &reply, sizeof(reply))) {
+	throw std::runtime_error("the tigz server closed the connection.");
+    }
+    std::string error(reply.message_nbytes, '\0');
+    if (!detail::receive_all(fd, error.data(), error.size())) {
+	throw std::runtime_error("the tigz server closed the connection.");
+    }
+    if (reply.status != 0) {
+	throw std::runtime_error(error);
+    }
+}
+
+// Run a job on the server listening on `socket_path`: read `in_fd` and
+// write the compressed (or decompressed) data to `out_fd`. Returns once
+// the server is done, and throws std::runtime_error with the server's
+// message if the job failed, or std::system_error if no server is
+// listening.
+inline void run_on_server(const std::string &socket_path, const ServerRequest &request, int in_fd, int out_fd) {
+    int fd = detail::connect_to(socket_path);
+    if (fd < 0) {
+	detail::throw_errno("can't connect to the tigz server at " + socket_path);
+    }
+    try {
+	run_on_connection(fd, request, in_fd, out_fd);
+    } catch (...) {
+	close(fd);
+	throw;
+    }
+    close(fd);
+}
+}
+
+#endif
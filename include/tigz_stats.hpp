@@ -0,0 +1,178 @@
+// BSD 3-Clause License
+//
+// Copyright (c) 2023, Tommi Mäklin
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from
+//    this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+#ifndef TIGZ_TIGZ_STATS_HPP
+#define TIGZ_TIGZ_STATS_HPP
+
+#include <cstddef>
+#include <string>
+#include <map>
+#include <thread>
+#include <chrono>
+#include <ostream>
+#include <algorithm>
+#include <limits>
+
+namespace tigz {
+using StatsClock = std::chrono::steady_clock;
+
+// Seconds elapsed since `start`
+inline double seconds_since(const StatsClock::time_point &start) {
+    return std::chrono::duration<double>(StatsClock::now() - start).count();
+}
+
+// Where the time of compressing or decompressing went. Times are in
+// seconds, `process_seconds` and `idle_seconds` are summed over the
+// threads in the pool.
+struct Stats {
+    size_t n_threads = 0;
+    double wall_seconds = 0.0;
+
+    // Reading the input, and the reader waiting for a free block
+    double read_seconds = 0.0;
+    double read_wait_seconds = 0.0;
+
+    // Compressing or decompressing blocks, in total and per thread,
+    // and the time the threads in the pool had nothing to do.
+    double process_seconds = 0.0;
+    std::map<std::thread::id, double> thread_process_seconds;
+    double idle_seconds = 0.0;
+
+    // Waiting for the next block to be processed, and writing it
+    double write_wait_seconds = 0.0;
+    double write_seconds = 0.0;
+
+    // Bytes read and written
+    size_t in_nbytes = 0;
+    size_t out_nbytes = 0;
+
+    // Compressed to uncompressed size of each block, binned to tenths.
+    // Blocks that grew are counted in the last bin.
+    size_t n_blocks = 0;
+    double min_block_ratio = std::numeric_limits<double>::max();
+    double max_block_ratio = 0.0;
+    size_t block_ratio_bins[10] = { 0 };
+
+    void add_block(size_t uncompressed_nbytes, size_t compressed_nbytes) {
+	if (uncompressed_nbytes == 0) {
+	    return;
+	}
+	double ratio = (double)compressed_nbytes/uncompressed_nbytes;
+	++this->n_blocks;
+	this->min_block_ratio = std::min(this->min_block_ratio, ratio);
+	this->max_block_ratio = std::max(this->max_block_ratio, ratio);
+	++this->block_ratio_bins[std::min((size_t)(ratio*10), (size_t)9)];
+    }
+
+    void add_process_seconds(const std::thread::id &thread, double seconds) {
+	this->process_seconds += seconds;
+	this->thread_process_seconds[thread] += seconds;
+    }
+
+    void merge(const Stats &other) {
+	this->n_threads = std::max(this->n_threads, other.n_threads);
+	this->wall_seconds += other.wall_seconds;
+	this->read_seconds += other.read_seconds;
+	this->read_wait_seconds += other.read_wait_seconds;
+	this->process_seconds += other.process_seconds;
+	for (const auto &thread : other.thread_process_seconds) {
+	    this->thread_process_seconds[thread.first] += thread.second;
+	}
+	this->idle_seconds += other.idle_seconds;
+	this->write_wait_seconds += other.write_wait_seconds;
+	this->write_seconds += other.write_seconds;
+	this->in_nbytes += other.in_nbytes;
+	this->out_nbytes += other.out_nbytes;
+	this->n_blocks += other.n_blocks;
+	this->min_block_ratio = std::min(this->min_block_ratio, other.min_block_ratio);
+	this->max_block_ratio = std::max(this->max_block_ratio, other.max_block_ratio);
+	for (size_t i = 0; i < 10; ++i) {
+	    this->block_ratio_bins[i] += other.block_ratio_bins[i];
+	}
+    }
+
+    // Write the stats as text, labelled with `part` if it is not empty
+    void write_text(std::ostream *out, const std::string &part = "") const {
+	*out << "tigz: stats" << (part.empty() ? "" : " (" + part + ")") << ": " << this->n_threads << " threads, " << this->wall_seconds << " s wall time\n"
+	     << "  read:    " << this->in_nbytes << " bytes in " << this->read_seconds << " s, "
+	     << this->read_wait_seconds << " s waiting for a free block\n"
+	     << "  process: " << this->process_seconds << " s (";
+	for (auto thread = this->thread_process_seconds.begin(); thread != this->thread_process_seconds.end(); ++thread) {
+	    *out << (thread == this->thread_process_seconds.begin() ? "" : ", ") << thread->second;
+	}
+	*out << " per thread), " << this->idle_seconds << " s idle in the pool\n"
+	     << "  write:   " << this->out_nbytes << " bytes in " << this->write_seconds << " s, "
+	     << this->write_wait_seconds << " s waiting for the next block\n";
+	if (this->n_blocks > 0) {
+	    *out << "  blocks:  " << this->n_blocks << ", compressed/uncompressed "
+		 << this->min_block_ratio << " min, " << this->max_block_ratio << " max, by tenths:";
+	    for (size_t i = 0; i < 10; ++i) {
+		*out << ' ' << this->block_ratio_bins[i];
+	    }
+	    *out << '\n';
+	}
+	out->flush();
+    }
+
+    // Write the stats as a JSON object, without a newline so that it
+    // can be nested in another object
+    void write_json_object(std::ostream *out) const {
+	*out << "{\"n_threads\": " << this->n_threads
+	     << ", \"wall_seconds\": " << this->wall_seconds
+	     << ", \"read_seconds\": " << this->read_seconds
+	     << ", \"read_wait_seconds\": " << this->read_wait_seconds
+	     << ", \"process_seconds\": " << this->process_seconds
+	     << ", \"thread_process_seconds\": [";
+	for (auto thread = this->thread_process_seconds.begin(); thread != this->thread_process_seconds.end(); ++thread) {
+	    *out << (thread == this->thread_process_seconds.begin() ? "" : ", ") << thread->second;
+	}
+	*out << "], \"idle_seconds\": " << this->idle_seconds
+	     << ", \"write_wait_seconds\": " << this->write_wait_seconds
+	     << ", \"write_seconds\": " << this->write_seconds
+	     << ", \"in_nbytes\": " << this->in_nbytes
+	     << ", \"out_nbytes\": " << this->out_nbytes
+	     << ", \"n_blocks\": " << this->n_blocks
+	     << ", \"min_block_ratio\": " << (this->n_blocks > 0 ? this->min_block_ratio : 0.0)
+	     << ", \"max_block_ratio\": " << this->max_block_ratio
+	     << ", \"block_ratio_bins\": [";
+	for (size_t i = 0; i < 10; ++i) {
+	    *out << (i > 0 ? ", " : "") << this->block_ratio_bins[i];
+	}
+	*out << "]}";
+    }
+
+    void write_json(std::ostream *out) const {
+	this->write_json_object(out);
+	*out << std::endl;
+    }
+};
+}
+
+#endif
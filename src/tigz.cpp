@@ -30,11 +30,17 @@
 //
 #include <unistd.h>
 #include <stdio.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/stat.h>
 
 #include <algorithm>
 #include <iostream>
 #include <exception>
 #include <filesystem>
+#include <fstream>
+#include <memory>
+#include <limits>
 
 #include "cxxopts.hpp"
 #include "rapidgzip.hpp"
@@ -42,6 +48,7 @@
 #include "tigz_version.h"
 #include "tigz_compressor.hpp"
 #include "tigz_decompressor.hpp"
+#include "tigz_server.hpp"
 
 bool CmdOptionPresent(char **begin, char **end, const std::string &option) {
     return (std::find(begin, end, option) != end);
@@ -51,11 +58,31 @@ bool parse_args(int argc, char* argv[], cxxopts::Options &options) {
     options.add_options()
 	("z,compress", "Compress file(s).", cxxopts::value<bool>()->default_value("false"))
 	("d,decompress", "Decompress file(s).", cxxopts::value<bool>()->default_value("false"))
+	("t,test", "Test the integrity of compressed file(s) without writing output.", cxxopts::value<bool>()->default_value("false"))
+	("recompress", "Decompress gzip file(s) and compress them again in place with the given level and format.", cxxopts::value<bool>()->default_value("false"))
 	("k,keep", "Keep input file(s) instead of deleting.", cxxopts::value<bool>()->default_value("false"))
 	("f,force", "Force overwrite output file(s).", cxxopts::value<bool>()->default_value("false"))
 	("c,stdout", "Write to standard out, keep files.", cxxopts::value<bool>()->default_value("false"))
 	("T,threads", "Use `arg` threads, 0 = all available.", cxxopts::value<size_t>()->default_value("1"))
-	("b,block-size", "i/o buffer sizes per thread in KiB.", cxxopts::value<size_t>()->default_value("128"))
+	("b,block-size", "i/o buffer sizes per thread in KiB, or `auto` to tune while compressing.", cxxopts::value<std::string>()->default_value("128"))
+	("dictionary", "Prime blocks with the previous 32 KiB and write a single gzip member.", cxxopts::value<bool>()->default_value("false"))
+	("format", "Compress to or decompress from `gzip`, `zlib`, or raw `deflate` streams.", cxxopts::value<std::string>()->default_value("gzip"))
+	("bgzf", "Compress to BGZF (blocked gzip) format.", cxxopts::value<bool>()->default_value("false"))
+	("gzi", "Write a .gzi index of the BGZF blocks for input file(s).", cxxopts::value<bool>()->default_value("false"))
+	("records", "Don't split `lines` or `fastq` records across gzip members.", cxxopts::value<std::string>()->default_value(""))
+	("record-index", "Write a .ridx index of the records in each member for input file(s).", cxxopts::value<bool>()->default_value("false"))
+	("memory-limit", "Limit the memory of the blocks in flight to `arg` MiB, 0 = no limit.", cxxopts::value<size_t>()->default_value("0"))
+	("huge-pages", "Back large buffers with transparent huge pages.", cxxopts::value<bool>()->default_value("false"))
+	("cpus", "Run on the CPUs in `arg`, e.g. `0-15,32-47`, one compression thread per CPU.", cxxopts::value<std::string>()->default_value(""))
+	("numa-node", "Run on the CPUs of NUMA node(s) `arg`, and allocate memory there.", cxxopts::value<std::string>()->default_value(""))
+	("direct", "Write compressed files with O_DIRECT, bypassing the page cache.", cxxopts::value<bool>()->default_value("false"))
+	("server", "Serve --client jobs on the Unix socket `arg`, running -T jobs at once.", cxxopts::value<std::string>()->default_value(""))
+	("client", "Send the jobs to the server on the Unix socket `arg`.", cxxopts::value<std::string>()->default_value(""))
+	("export-index", "Write the decompression index of the input file to `arg`.", cxxopts::value<std::string>()->default_value(""))
+	("import-index", "Decompress the input file using the index in `arg`.", cxxopts::value<std::string>()->default_value(""))
+	("offset", "Decompress starting from uncompressed byte `arg`.", cxxopts::value<size_t>()->default_value("0"))
+	("length", "Decompress only `arg` bytes, 0 = until the end.", cxxopts::value<size_t>()->default_value("0"))
+	("stats", "Print timings and counters to stderr as `text` or `json`.", cxxopts::value<std::string>()->implicit_value("text")->default_value(""))
 	("h,help", "Print this message and quit.", cxxopts::value<bool>()->default_value("false"))
 	("V,version", "Print the version and quit.", cxxopts::value<bool>()->default_value("false"))
 	("filenames", "Input files as positional arguments", cxxopts::value<std::vector<std::string>>()->default_value(""));
@@ -76,11 +103,121 @@ bool parse_args(int argc, char* argv[], cxxopts::Options &options) {
     return false; // parsing successfull
 }
 
+void print_stats(const tigz::Stats &stats, const std::string &format) {
+    if (format == "json") {
+	stats.write_json(&std::cerr);
+    } else if (!format.empty()) {
+	stats.write_text(&std::cerr);
+    }
+}
+
+// Stats of recompressing: one JSON object with the decompressor's and
+// the compressor's stats, or a labelled text report of each
+void print_recompress_stats(const tigz::Stats &decompress_stats, const tigz::Stats &compress_stats, const std::string &format) {
+    if (format == "json") {
+	std::cerr << "{\"decompress\": ";
+	decompress_stats.write_json_object(&std::cerr);
+	std::cerr << ", \"compress\": ";
+	compress_stats.write_json_object(&std::cerr);
+	std::cerr << '}' << std::endl;
+    } else if (!format.empty()) {
+	decompress_stats.write_text(&std::cerr, "decompress");
+	compress_stats.write_text(&std::cerr, "compress");
+    }
+}
+
+// Give `to` the mode of `from` and, where allowed, its owner and group
+void copy_mode_and_owner(const std::string &from, const std::string &to) {
+    struct stat from_stat;
+    if (stat(from.c_str(), &from_stat) != 0) {
+	throw std::runtime_error("can't read the mode of " + from + ".");
+    }
+    // Only root can give a file to another user, so that may fail.
+    // chown can clear the setuid and setgid bits, so it goes first.
+    if (chown(to.c_str(), from_stat.st_uid, from_stat.st_gid) != 0 && errno != EPERM) {
+	throw std::system_error(errno, std::generic_category(), "can't set the owner of " + to);
+    }
+    std::filesystem::permissions(to, static_cast<std::filesystem::perms>(from_stat.st_mode & 07777));
+}
+
 bool file_exists(const std::string &file_path) {
     std::filesystem::path check_file{ file_path };
     return std::filesystem::exists(check_file);
 }
 
+// Suffix of compressed files: .gz, .zz for zlib, or .deflate for raw deflate
+std::string compressed_suffix(tigz::Format format) {
+    return (format == tigz::Format::gzip ? ".gz" : (format == tigz::Format::zlib ? ".zz" : ".deflate"));
+}
+
+// Server run by --server, stopped by SIGINT and SIGTERM
+tigz::Server *running_server = nullptr;
+void stop_server(int) {
+    if (running_server != nullptr) {
+	running_server->stop();
+    }
+}
+
+// Compress or decompress `input_files`, or stdin to stdout if there are
+// none, on the server listening on `socket_path`. The files are opened
+// here and their descriptors passed to the server.
+int run_on_server(const std::string &socket_path, const tigz::ServerRequest &request, const std::vector<std::string> &input_files,
+		  tigz::Format format, bool to_stdout, bool keep, bool force) {
+    if (input_files[0].empty()) {
+	try {
+	    tigz::run_on_server(socket_path, request, STDIN_FILENO, STDOUT_FILENO);
+	} catch (const std::exception &e) {
+	    std::cerr << "tigz: stdin: " << e.what() << std::endl;
+	    return 1;
+	}
+	return 0;
+    }
+
+    for (const std::string &infile : input_files) {
+	if (!file_exists(infile)) {
+	    std::cerr << "tigz: " << infile << ": no such file or directory." << std::endl;
+	    return 1;
+	}
+	std::string outfile;
+	if (!to_stdout && request.mode == tigz::ServerRequest::compress) {
+	    outfile = infile + compressed_suffix(format);
+	} else if (!to_stdout) {
+	    outfile = infile.substr(0, infile.find_last_of("."));
+	}
+	if (!outfile.empty() && file_exists(outfile) && !force) {
+	    std::cerr << "tigz: " << outfile << ": file exists; use `--force` to overwrite." << std::endl;
+	    return 1;
+	}
+
+	int in_fd = open(infile.c_str(), O_RDONLY | O_CLOEXEC);
+	int out_fd = (outfile.empty() ? STDOUT_FILENO : open(outfile.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644));
+	try {
+	    if (in_fd < 0 || out_fd < 0) {
+		throw std::system_error(errno, std::generic_category(), "can't open " + (in_fd < 0 ? infile : outfile));
+	    }
+	    tigz::run_on_server(socket_path, request, in_fd, out_fd);
+	} catch (const std::exception &e) {
+	    std::cerr << "tigz: " << infile << ": " << e.what() << std::endl;
+	    if (in_fd >= 0) {
+		close(in_fd);
+	    }
+	    if (!outfile.empty() && out_fd >= 0) {
+		close(out_fd);
+		std::filesystem::remove(outfile);
+	    }
+	    return 1;
+	}
+	close(in_fd);
+	if (!outfile.empty()) {
+	    close(out_fd);
+	    if (!keep) {
+		std::filesystem::remove(infile);
+	    }
+	}
+    }
+    return 0;
+}
+
 int main(int argc, char* argv[]) {
     cxxopts::Options opts("tigz", "tigz: compress or decompress gzip files in parallel.");
     size_t compression_level = 6;
@@ -110,13 +247,274 @@ int main(int argc, char* argv[]) {
     // n_threads == 0 implies use all available threads
     size_t n_threads = args["threads"].as<size_t>();
 
-    // Convert block size to kilobytes
-    size_t block_size = args["block-size"].as<size_t>() * 1024;
+    // Convert block size to kilobytes, auto starts from the default
+    const std::string &block_size_arg = args["block-size"].as<std::string>();
+    bool auto_block_size = (block_size_arg == "auto");
+    size_t block_size = 128 * 1024;
+    if (!auto_block_size) {
+	try {
+	    size_t n_chars = 0;
+	    block_size = std::stoul(block_size_arg, &n_chars) * 1024;
+	    if (n_chars != block_size_arg.size() || block_size == 0) {
+		throw std::invalid_argument(block_size_arg);
+	    }
+	} catch (const std::exception &e) {
+	    std::cerr << "tigz: --block-size must be a positive number of KiB or `auto`." << std::endl;
+	    return 1;
+	}
+    }
 
     // 0 == read from cin
     const std::vector<std::string> &input_files = args["filenames"].as<std::vector<std::string>>();
     size_t n_input_files = input_files.size();
 
+    // Empty if stats are not printed
+    const std::string &stats_format = args["stats"].as<std::string>();
+    if (!stats_format.empty() && stats_format != "text" && stats_format != "json") {
+	std::cerr << "tigz: --stats must be `text` or `json`." << std::endl;
+	return 1;
+    }
+
+    // Container of the compressed data
+    tigz::Format format = tigz::Format::gzip;
+    try {
+	format = tigz::parse_format(args["format"].as<std::string>());
+    } catch (const std::invalid_argument &) {
+	std::cerr << "tigz: --format must be `gzip`, `zlib`, or `deflate`." << std::endl;
+	return 1;
+    }
+    if (format != tigz::Format::gzip && (args["bgzf"].as<bool>() || args["recompress"].as<bool>())) {
+	std::cerr << "tigz: --bgzf and --recompress only write gzip; can't use with --format." << std::endl;
+	return 1;
+    }
+
+    // Records that are kept within one gzip member
+    const std::string &records_arg = args["records"].as<std::string>();
+    tigz::RecordFormat record_format = tigz::RecordFormat::none;
+    if (records_arg == "lines") {
+	record_format = tigz::RecordFormat::lines;
+    } else if (records_arg == "fastq") {
+	record_format = tigz::RecordFormat::fastq;
+    } else if (!records_arg.empty()) {
+	std::cerr << "tigz: --records must be `lines` or `fastq`." << std::endl;
+	return 1;
+    }
+    if (record_format != tigz::RecordFormat::none && format != tigz::Format::gzip) {
+	std::cerr << "tigz: --records needs gzip members; can't use with --format." << std::endl;
+	return 1;
+    }
+    if (record_format != tigz::RecordFormat::none && args["dictionary"].as<bool>()) {
+	std::cerr << "tigz: --records can't be used with --dictionary." << std::endl;
+	return 1;
+    }
+    if (args["record-index"].as<bool>() && record_format == tigz::RecordFormat::none) {
+	std::cerr << "tigz: --record-index requires --records." << std::endl;
+	return 1;
+    }
+
+    // CPUs to run on. The whole process is restricted to them so that the
+    // reader, the writer, and rapidgzip's threads stay there too, and
+    // memory is first touched on their NUMA nodes. -T 0 uses one thread
+    // per CPU.
+    const std::string &cpus_arg = args["cpus"].as<std::string>();
+    const std::string &numa_node_arg = args["numa-node"].as<std::string>();
+    if (!cpus_arg.empty() && !numa_node_arg.empty()) {
+	std::cerr << "tigz: --cpus and --numa-node can't be used together." << std::endl;
+	return 1;
+    }
+    std::vector<int> cpus;
+    try {
+	cpus = (!numa_node_arg.empty() ? tigz::numa_node_cpus(numa_node_arg) : tigz::parse_cpu_list(cpus_arg));
+	tigz::set_thread_cpus(cpus);
+    } catch (const std::exception &e) {
+	std::cerr << "tigz: " << e.what() << std::endl;
+	return 1;
+    }
+
+    // Buffers of the blocks in flight come from this pool
+    std::shared_ptr<tigz::BufferPool> buffer_pool = std::make_shared<tigz::BufferPool>(args["memory-limit"].as<size_t>() * 1024 * 1024, args["huge-pages"].as<bool>());
+
+    const std::string &server_socket = args["server"].as<std::string>();
+    const std::string &client_socket = args["client"].as<std::string>();
+    if (!server_socket.empty()) {
+	// Keep compressors and decompressors warm and run the jobs sent
+	// with --client until stopped. The jobs take their level, format,
+	// --dictionary, and --bgzf from the client.
+	if (!client_socket.empty() || !input_files[0].empty()) {
+	    std::cerr << "tigz: --server takes no input files and can't be used with --client." << std::endl;
+	    return 1;
+	}
+	// A client that goes away only fails its own job
+	signal(SIGPIPE, SIG_IGN);
+	try {
+	    size_t n_jobs = (n_threads == 0 && !cpus.empty() ? cpus.size() : n_threads);
+	    tigz::Server server(server_socket, n_jobs, block_size);
+	    server.set_buffer_pool(buffer_pool);
+	    running_server = &server;
+	    signal(SIGINT, stop_server);
+	    signal(SIGTERM, stop_server);
+	    server.serve();
+	    running_server = nullptr;
+	} catch (const std::exception &e) {
+	    running_server = nullptr;
+	    std::cerr << "tigz: " << e.what() << std::endl;
+	    return 1;
+	}
+	return 0;
+    }
+
+    if (!client_socket.empty()) {
+	// Only plain compression and decompression are forwarded
+	const std::vector<std::string> unsupported = { "test", "recompress", "gzi", "records", "record-index", "direct", "stats",
+						       "export-index", "import-index", "offset", "length" };
+	for (const std::string &option : unsupported) {
+	    if (args.count(option) > 0) {
+		std::cerr << "tigz: --" << option << " can't be used with --client." << std::endl;
+		return 1;
+	    }
+	}
+	bool decompress = (args["decompress"].as<bool>() && !args["compress"].as<bool>());
+	if (!decompress && input_files[0].empty() && !args["force"].as<bool>() && isatty(fileno(stdout))) {
+	    std::cerr << "tigz: refusing to write compressed data to terminal. Use -f to force write.\ntigz: try `tigz --help` for help." << std::endl;
+	    return 1;
+	}
+	tigz::ServerRequest request;
+	request.mode = (decompress ? tigz::ServerRequest::decompress : tigz::ServerRequest::compress);
+	request.level = compression_level;
+	request.format = static_cast<uint8_t>(format);
+	request.flags = (args["dictionary"].as<bool>() ? tigz::ServerRequest::dictionary : 0) |
+			(args["bgzf"].as<bool>() ? tigz::ServerRequest::bgzf : 0);
+	return run_on_server(client_socket, request, input_files, format, args["stdout"].as<bool>(),
+			     args["keep"].as<bool>(), args["force"].as<bool>());
+    }
+
+
+    if (args["test"].as<bool>()) {
+	// Decode the inputs, or cin, and only report corrupt files
+	std::vector<std::string> test_files = input_files;
+	if (input_files[0].empty() && isatty(fileno(stdin))) {
+	    std::cerr << "tigz: no input to test.\ntigz: try `tigz --help` for help." << std::endl;
+	    return 1;
+	}
+	for (size_t i = 0; i < n_input_files; ++i) {
+	    if (!test_files[i].empty() && !file_exists(test_files[i])) {
+		std::cerr << "tigz: " << test_files[i] << ": no such file or directory." << std::endl;
+		return 1;
+	    }
+	}
+
+	tigz::ParallelDecompressor decomp(n_threads, block_size);
+	decomp.set_buffer_pool(buffer_pool);
+	decomp.set_cpus(cpus);
+	decomp.set_format(format);
+	decomp.set_stats(!stats_format.empty());
+	const std::vector<tigz::TestResult> &results = decomp.test_files(test_files);
+	print_stats(decomp.get_stats(), stats_format);
+	bool all_ok = true;
+	for (size_t i = 0; i < n_input_files; ++i) {
+	    if (!results[i].ok) {
+		all_ok = false;
+		std::cerr << "tigz: " << (test_files[i].empty() ? "stdin" : test_files[i]) << ": ";
+		if (results[i].member_offset != std::numeric_limits<size_t>::max()) {
+		    std::cerr << "corrupt member at byte " << results[i].member_offset << ": ";
+		}
+		std::cerr << results[i].error << std::endl;
+	    }
+	}
+	return (all_ok ? 0 : 1);
+    }
+
+    if (args["recompress"].as<bool>()) {
+	// Decompressed chunks go straight into the compressor. Files are
+	// replaced once recompressed, cin is recompressed to cout.
+	std::vector<std::string> recompress_files = input_files;
+	bool to_stdout = (input_files[0].empty() || args["stdout"].as<bool>());
+	if (input_files[0].empty() && isatty(fileno(stdin))) {
+	    std::cerr << "tigz: no input to recompress.\ntigz: try `tigz --help` for help." << std::endl;
+	    return 1;
+	}
+	if (to_stdout && !args["force"].as<bool>() && isatty(fileno(stdout))) {
+	    std::cerr << "tigz: refusing to write compressed data to terminal. Use -f to force write.\ntigz: try `tigz --help` for help." << std::endl;
+	    return 1;
+	}
+	for (size_t i = 0; i < n_input_files; ++i) {
+	    if (!recompress_files[i].empty() && !file_exists(recompress_files[i])) {
+		std::cerr << "tigz: " << recompress_files[i] << ": no such file or directory." << std::endl;
+		return 1;
+	    }
+	}
+	if (args["gzi"].as<bool>() || args["record-index"].as<bool>()) {
+	    std::cerr << "tigz: WARNING: no index is written when recompressing." << std::endl;
+	}
+
+	// Decompressing runs at the same time as compressing and is several
+	// times faster per thread, so it gets a quarter of the threads (and
+	// CPUs) and compressing the rest instead of both using all of them.
+	size_t n_total_threads = (n_threads > 0 ? n_threads : (cpus.empty() ? tigz::available_cpu_count() : cpus.size()));
+	size_t n_decompress_threads = std::max(n_total_threads/4, (size_t)1);
+	size_t n_compress_threads = std::max(n_total_threads - n_decompress_threads, (size_t)1);
+	std::vector<int> decompress_cpus = cpus;
+	std::vector<int> compress_cpus = cpus;
+	if (cpus.size() > 1) {
+	    size_t n_decompress_cpus = std::max(cpus.size()/4, (size_t)1);
+	    compress_cpus.assign(cpus.begin(), cpus.end() - n_decompress_cpus);
+	    decompress_cpus.assign(cpus.end() - n_decompress_cpus, cpus.end());
+	}
+
+	tigz::ParallelDecompressor decomp(n_decompress_threads, block_size);
+	decomp.set_buffer_pool(buffer_pool);
+	decomp.set_cpus(decompress_cpus);
+	decomp.set_format(format);
+	decomp.set_stats(!stats_format.empty());
+	tigz::ParallelCompressor cmp(n_compress_threads, compression_level, block_size, block_size);
+	cmp.set_dictionary(args["dictionary"].as<bool>());
+	cmp.set_bgzf(args["bgzf"].as<bool>());
+	cmp.set_auto_block_size(auto_block_size);
+	cmp.set_buffer_pool(buffer_pool);
+	cmp.set_cpus(compress_cpus);
+	cmp.set_format(format);
+	cmp.set_record_format(record_format);
+	cmp.set_stats(!stats_format.empty());
+
+	for (size_t i = 0; i < n_input_files; ++i) {
+	    const std::string &infile = recompress_files[i];
+	    std::string tmp_file = infile + ".tigz-tmp";
+	    std::ofstream out_file;
+	    std::ostream *out = &std::cout;
+	    if (!to_stdout) {
+		out_file.open(tmp_file, std::ios::binary);
+		out = &out_file;
+	    }
+	    try {
+		cmp.open([out](const char *data, size_t nbytes) { out->write(data, nbytes); });
+		decomp.decompress_file(infile, [&cmp](const char *data, size_t nbytes) { cmp.write(data, nbytes); });
+		cmp.finish();
+		out->flush();
+		if (out->fail()) {
+		    throw std::runtime_error("writing the output failed.");
+		}
+		if (!to_stdout) {
+		    out_file.close();
+		    if (out_file.fail()) {
+			throw std::runtime_error("writing the output failed.");
+		    }
+		    copy_mode_and_owner(infile, tmp_file);
+		}
+	    } catch (const std::exception &e) {
+		std::cerr << "tigz: " << (infile.empty() ? "stdin" : infile) << ": " << e.what() << std::endl;
+		if (!to_stdout) {
+		    out_file.close();
+		    std::filesystem::remove(tmp_file);
+		}
+		return 1;
+	    }
+	    if (!to_stdout) {
+		std::filesystem::rename(tmp_file, infile);
+	    }
+	}
+	print_recompress_stats(decomp.get_stats(), cmp.get_stats(), stats_format);
+	return 0;
+    }
 
     if (!args["force"].as<bool>() && !args["decompress"].as<bool>() && input_files[0].empty()) {
 	// Refuse to write to terminal without -f or -c
@@ -128,14 +526,39 @@ int main(int argc, char* argv[]) {
     if (!isatty(fileno(stdin))) {
 	// Compress from cin to cout
 	if (args["decompress"].as<bool>()) {
-	    if (n_threads > 1) {
-		std::cerr << "tigz: WARNING: will use only use a single thread when decompressing input from stdin." << std::endl;
-	    }
 	    tigz::ParallelDecompressor decomp(n_threads, block_size);
-	    decomp.decompress_stream(&std::cin, &std::cout);
+	    decomp.set_buffer_pool(buffer_pool);
+	    decomp.set_cpus(cpus);
+	    decomp.set_format(format);
+	    decomp.set_stats(!stats_format.empty());
+	    std::string to_stdout;
+	    try {
+		decomp.decompress_file("", to_stdout);
+	    } catch (const std::exception &e) {
+		std::cerr << "tigz: " << e.what() << std::endl;
+		return 1;
+	    }
+	    print_stats(decomp.get_stats(), stats_format);
 	} else {
 	    tigz::ParallelCompressor cmp(n_threads, compression_level, block_size, block_size);
-	    cmp.compress_stream(&std::cin, &std::cout);
+	    cmp.set_dictionary(args["dictionary"].as<bool>());
+	    cmp.set_bgzf(args["bgzf"].as<bool>());
+	    cmp.set_auto_block_size(auto_block_size);
+	    cmp.set_buffer_pool(buffer_pool);
+	    cmp.set_cpus(cpus);
+	    cmp.set_format(format);
+	    cmp.set_record_format(record_format);
+	    if (args["gzi"].as<bool>() || args["record-index"].as<bool>()) {
+		std::cerr << "tigz: WARNING: no index is written when compressing from stdin." << std::endl;
+	    }
+	    cmp.set_stats(!stats_format.empty());
+	    try {
+		cmp.compress_stream(&std::cin, &std::cout);
+	    } catch (const std::exception &e) {
+		std::cerr << "tigz: stdin: " << e.what() << std::endl;
+		return 1;
+	    }
+	    print_stats(cmp.get_stats(), stats_format);
 	}
     }
     if (!input_files[0].empty()) {
@@ -145,30 +568,67 @@ int main(int argc, char* argv[]) {
 	    //
 	    // Reuse compressor
 	    tigz::ParallelCompressor cmp(n_threads, compression_level, block_size, block_size);
+	    cmp.set_dictionary(args["dictionary"].as<bool>());
+	    cmp.set_bgzf(args["bgzf"].as<bool>());
+	    cmp.set_auto_block_size(auto_block_size);
+	    cmp.set_buffer_pool(buffer_pool);
+	    cmp.set_cpus(cpus);
+	    cmp.set_format(format);
+	    cmp.set_record_format(record_format);
+	    cmp.set_direct_io(args["direct"].as<bool>());
+
+	    // Check all files first, then compress them together
+	    std::vector<std::string> out_files(n_input_files);
+	    std::vector<std::string> gzi_files(n_input_files);
+	    std::vector<std::string> record_index_files(n_input_files);
 	    for (size_t i = 0; i < n_input_files; ++i) {
 		const std::string &infile = input_files[i];
 		if (!file_exists(infile)) {
 		    std::cerr << "tigz: " << infile << ": no such file or directory." << std::endl;
 		    return 1;
 		}
-		std::ifstream in_stream(infile);
-		if (!args["stdout"].as<bool>()) {
-		    // Add .gz suffix to infile name
-		    const std::string &outfile = infile + ".gz";
-		    if (file_exists(outfile) && !args["force"].as<bool>()) {
-			std::cerr << "tigz: " << outfile << ": file exists; use `--force` to overwrite." << std::endl;
+
+		// BGZF index is written to `infile`.gz.gzi
+		if (args["bgzf"].as<bool>() && args["gzi"].as<bool>()) {
+		    gzi_files[i] = infile + ".gz.gzi";
+		    if (file_exists(gzi_files[i]) && !args["force"].as<bool>()) {
+			std::cerr << "tigz: " << gzi_files[i] << ": file exists; use `--force` to overwrite." << std::endl;
 			return 1;
 		    }
-		    std::ofstream out_stream(outfile);
+		}
 
-		    cmp.compress_stream(&in_stream, &out_stream);
-		} else {
-		    // Compress to cout
-		    cmp.compress_stream(&in_stream, &std::cout);
+		// Record index is written to `infile`.gz.ridx
+		if (args["record-index"].as<bool>()) {
+		    record_index_files[i] = infile + ".gz.ridx";
+		    if (file_exists(record_index_files[i]) && !args["force"].as<bool>()) {
+			std::cerr << "tigz: " << record_index_files[i] << ": file exists; use `--force` to overwrite." << std::endl;
+			return 1;
+		    }
 		}
 
-		if (!args["keep"].as<bool>() && !args["stdout"].as<bool>()) {
-		    std::filesystem::path remove_file{ infile };
+		// Add .gz (.zz for zlib, .deflate for raw deflate) suffix to
+		// infile name, or compress to cout
+		if (!args["stdout"].as<bool>()) {
+		    out_files[i] = infile + compressed_suffix(format);
+		    if (file_exists(out_files[i]) && !args["force"].as<bool>()) {
+			std::cerr << "tigz: " << out_files[i] << ": file exists; use `--force` to overwrite." << std::endl;
+			return 1;
+		    }
+		}
+	    }
+
+	    cmp.set_stats(!stats_format.empty());
+	    try {
+		cmp.compress_files(input_files, out_files, gzi_files, record_index_files);
+	    } catch (const std::exception &e) {
+		std::cerr << "tigz: " << e.what() << std::endl;
+		return 1;
+	    }
+	    print_stats(cmp.get_stats(), stats_format);
+
+	    if (!args["keep"].as<bool>() && !args["stdout"].as<bool>()) {
+		for (size_t i = 0; i < n_input_files; ++i) {
+		    std::filesystem::path remove_file{ input_files[i] };
 		    std::filesystem::remove(remove_file);
 		}
 	    }
@@ -177,6 +637,34 @@ int main(int argc, char* argv[]) {
 	    //
 	    // Reuse decompressor
 	    tigz::ParallelDecompressor decomp(n_threads, block_size);
+
+	    // Index and range extraction options only apply to a single file
+	    const std::string &export_index = args["export-index"].as<std::string>();
+	    const std::string &import_index = args["import-index"].as<std::string>();
+	    size_t offset = args["offset"].as<size_t>();
+	    size_t length = (args["length"].as<size_t>() > 0 ? args["length"].as<size_t>() : std::numeric_limits<size_t>::max());
+	    bool index_or_range = (!export_index.empty() || !import_index.empty() || offset > 0 || length != std::numeric_limits<size_t>::max());
+	    if (index_or_range && n_input_files > 1) {
+		std::cerr << "tigz: --export-index, --import-index, --offset, and --length accept only one input file." << std::endl;
+		return 1;
+	    }
+	    if (index_or_range && format != tigz::Format::gzip) {
+		std::cerr << "tigz: --export-index, --import-index, --offset, and --length only support gzip input." << std::endl;
+		return 1;
+	    }
+	    if (!export_index.empty() && (offset > 0 || length != std::numeric_limits<size_t>::max())) {
+		std::cerr << "tigz: --export-index requires decompressing the whole file; can't use with --offset or --length." << std::endl;
+		return 1;
+	    }
+	    decomp.set_export_index(export_index);
+	    decomp.set_import_index(import_index);
+	    decomp.set_buffer_pool(buffer_pool);
+	    decomp.set_cpus(cpus);
+	    decomp.set_format(format);
+	    decomp.set_stats(!stats_format.empty());
+
+	    // Check all files first, then decompress them together
+	    std::vector<std::string> out_files(n_input_files);
 	    for (size_t i = 0; i < n_input_files; ++i) {
 		const std::string &infile = input_files[i];
 		if (!file_exists(infile)) {
@@ -188,17 +676,30 @@ int main(int argc, char* argv[]) {
 		size_t lastindex = infile.find_last_of(".");
 
 		// Decompresses to cout if `outfile` equals empty
-		std::string outfile = (args["stdout"].as<bool>() ? "" : infile.substr(0, lastindex));
+		out_files[i] = (args["stdout"].as<bool>() ? "" : infile.substr(0, lastindex));
 
-		if (file_exists(outfile) && !args["force"].as<bool>()) {
-		    std::cerr << "tigz: " << outfile << ": file exists; use `--force` to overwrite." << std::endl;
+		if (file_exists(out_files[i]) && !args["force"].as<bool>()) {
+		    std::cerr << "tigz: " << out_files[i] << ": file exists; use `--force` to overwrite." << std::endl;
 		    return 1;
 		}
+	    }
 
-		decomp.decompress_file(infile, outfile);
+	    try {
+		if (index_or_range) {
+		    decomp.decompress_file(input_files[0], out_files[0], offset, length);
+		} else {
+		    decomp.decompress_files(input_files, out_files);
+		}
+	    } catch (const std::exception &e) {
+		std::cerr << "tigz: " << e.what() << std::endl;
+		return 1;
+	    }
+	    print_stats(decomp.get_stats(), stats_format);
 
-		if (!args["keep"].as<bool>() && !args["stdout"].as<bool>()) {
-		    std::filesystem::path remove_file{ infile };
+	    // A range or index run does not reproduce the whole input, keep it
+	    if (!args["keep"].as<bool>() && !args["stdout"].as<bool>() && !index_or_range) {
+		for (size_t i = 0; i < n_input_files; ++i) {
+		    std::filesystem::path remove_file{ input_files[i] };
 		    std::filesystem::remove(remove_file);
 		}
 	    }
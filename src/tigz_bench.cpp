@@ -0,0 +1,344 @@
+// BSD 3-Clause License
+//
+// Copyright (c) 2023, Tommi Mäklin
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from
+//    this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+#include <unistd.h>
+
+#include <algorithm>
+#include <iostream>
+#include <fstream>
+#include <exception>
+#include <filesystem>
+#include <random>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <map>
+#include <limits>
+#include <thread>
+
+#include "cxxopts.hpp"
+#include "rapidgzip.hpp"
+#include "libdeflate.h"
+
+#include "tigz_version.h"
+#include "tigz_compressor.hpp"
+#include "tigz_decompressor.hpp"
+
+// Reproducible benchmark corpora. All generators use a fixed seed so
+// that results are comparable between builds and dependency versions.
+std::string random_corpus(size_t nbytes) {
+    std::mt19937_64 rng(1);
+    std::string corpus(nbytes, '\0');
+    for (size_t i = 0; i < nbytes; i += 8) {
+	uint64_t value = rng();
+	for (size_t j = 0; j < 8 && i + j < nbytes; ++j) {
+	    corpus[i + j] = (value >> (8*j)) & 0xff;
+	}
+    }
+    return corpus;
+}
+
+std::string text_corpus(size_t nbytes, uint64_t seed = 2) {
+    // Words drawn from a skewed distribution over a fixed vocabulary
+    std::mt19937_64 rng(seed);
+    std::vector<std::string> vocabulary;
+    std::uniform_int_distribution<size_t> word_length(2, 10);
+    std::uniform_int_distribution<int> letter('a', 'z');
+    for (size_t i = 0; i < 4096; ++i) {
+	std::string word(word_length(rng), 'a');
+	for (char &c : word) {
+	    c = letter(rng);
+	}
+	vocabulary.emplace_back(word);
+    }
+    std::geometric_distribution<size_t> word_rank(0.01);
+    std::uniform_int_distribution<size_t> line_length(4, 16);
+
+    std::string corpus;
+    corpus.reserve(nbytes + 256);
+    while (corpus.size() < nbytes) {
+	size_t n_words = line_length(rng);
+	for (size_t i = 0; i < n_words; ++i) {
+	    corpus += vocabulary[word_rank(rng) % vocabulary.size()];
+	    corpus += (i + 1 < n_words ? ' ' : '\n');
+	}
+    }
+    corpus.resize(nbytes);
+    return corpus;
+}
+
+std::string fastq_corpus(size_t nbytes) {
+    // 150 bp reads with Illumina-like quality strings
+    std::mt19937_64 rng(3);
+    const char bases[4] = { 'A', 'C', 'G', 'T' };
+    std::uniform_int_distribution<size_t> base(0, 3);
+    std::normal_distribution<double> quality(35.0, 4.0);
+
+    std::string corpus;
+    corpus.reserve(nbytes + 512);
+    for (size_t read = 0; corpus.size() < nbytes; ++read) {
+	corpus += "@SIM:1:FCX:1:" + std::to_string(1101 + read % 16) + ":" + std::to_string(read) + " 1:N:0:ACGT\n";
+	for (size_t i = 0; i < 150; ++i) {
+	    corpus += bases[base(rng)];
+	}
+	corpus += "\n+\n";
+	for (size_t i = 0; i < 150; ++i) {
+	    corpus += (char)(33 + std::clamp((int)quality(rng), 2, 41));
+	}
+	corpus += '\n';
+    }
+    corpus.resize(nbytes);
+    return corpus;
+}
+
+std::string compressed_corpus(size_t nbytes) {
+    // Text compressed with libdeflate in 1 MiB members
+    libdeflate_compressor *compressor = libdeflate_alloc_compressor(6);
+    std::string corpus;
+    std::string member;
+    for (uint64_t seed = 100; corpus.size() < nbytes; ++seed) {
+	const std::string &text = text_corpus(1048576, seed);
+	member.resize(libdeflate_gzip_compress_bound(compressor, text.size()));
+	size_t out_nbytes = libdeflate_gzip_compress(compressor, text.data(), text.size(), member.data(), member.size());
+	corpus.append(member.data(), out_nbytes);
+    }
+    libdeflate_free_compressor(compressor);
+    corpus.resize(nbytes);
+    return corpus;
+}
+
+// Reset the peak resident set size of this process (Linux only)
+void reset_peak_rss() {
+    std::ofstream clear_refs("/proc/self/clear_refs");
+    clear_refs << "5";
+}
+
+// Peak resident set size since the last call to `reset_peak_rss`, or 0 if
+// it is not available on this system.
+size_t peak_rss_bytes() {
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line)) {
+	if (line.rfind("VmHWM:", 0) == 0) {
+	    return std::stoull(line.substr(6))*1024;
+	}
+    }
+    return 0;
+}
+
+struct Result {
+    std::string corpus;
+    std::string operation;
+    size_t threads;
+    size_t block_size;
+    size_t level;
+    size_t in_nbytes;
+    size_t out_nbytes;
+    double seconds;
+    size_t peak_rss;
+};
+
+template <typename F>
+double best_time(size_t repeats, size_t *peak_rss, F run) {
+    double best = std::numeric_limits<double>::max();
+    *peak_rss = 0;
+    for (size_t i = 0; i < repeats; ++i) {
+	reset_peak_rss();
+	auto start = std::chrono::steady_clock::now();
+	run();
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	best = std::min(best, elapsed.count());
+	*peak_rss = std::max(*peak_rss, peak_rss_bytes());
+    }
+    return best;
+}
+
+void write_json(const std::vector<Result> &results, size_t corpus_size, std::ostream *out) {
+    // Scaling efficiency is relative to the single thread run with the same settings
+    std::map<std::string, double> single_thread_throughput;
+    const auto key = [](const Result &result) {
+	return result.corpus + "/" + result.operation + "/" + std::to_string(result.block_size) + "/" + std::to_string(result.level);
+    };
+    for (const Result &result : results) {
+	if (result.threads == 1) {
+	    single_thread_throughput[key(result)] = result.in_nbytes/result.seconds;
+	}
+    }
+
+    *out << "{\n"
+	 << "  \"tigz_version\": \"" << TIGZ_BUILD_VERSION << "\",\n"
+	 << "  \"hardware_concurrency\": " << std::thread::hardware_concurrency() << ",\n"
+	 << "  \"corpus_size\": " << corpus_size << ",\n"
+	 << "  \"results\": [\n";
+    for (size_t i = 0; i < results.size(); ++i) {
+	const Result &result = results[i];
+	double mb_per_s = result.in_nbytes/result.seconds/1e6;
+	size_t uncompressed_nbytes = (result.operation == "compress" ? result.in_nbytes : result.out_nbytes);
+	size_t compressed_nbytes = (result.operation == "compress" ? result.out_nbytes : result.in_nbytes);
+	*out << "    {\"corpus\": \"" << result.corpus << "\", "
+	     << "\"operation\": \"" << result.operation << "\", "
+	     << "\"threads\": " << result.threads << ", "
+	     << "\"block_size\": " << result.block_size << ", "
+	     << "\"level\": " << result.level << ", "
+	     << "\"seconds\": " << result.seconds << ", "
+	     << "\"mb_per_s\": " << mb_per_s << ", "
+	     << "\"ratio\": " << (double)compressed_nbytes/uncompressed_nbytes << ", "
+	     << "\"peak_rss_bytes\": " << result.peak_rss << ", "
+	     << "\"scaling_efficiency\": ";
+	auto single_thread = single_thread_throughput.find(key(result));
+	if (single_thread != single_thread_throughput.end()) {
+	    *out << (result.in_nbytes/result.seconds)/(result.threads*single_thread->second);
+	} else {
+	    *out << "null";
+	}
+	*out << "}" << (i + 1 < results.size() ? "," : "") << '\n';
+    }
+    *out << "  ]\n}" << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+    cxxopts::Options options("tigz_bench", "tigz_bench: benchmark tigz compression and decompression.");
+    options.add_options()
+	("size", "Size of each corpus in MiB.", cxxopts::value<size_t>()->default_value("64"))
+	("corpora", "Corpora to use from random, text, fastq, compressed.", cxxopts::value<std::vector<std::string>>()->default_value("random,text,fastq,compressed"))
+	("T,threads", "Thread counts to run, 0 = all available.", cxxopts::value<std::vector<size_t>>()->default_value("1,2,4,0"))
+	("b,block-sizes", "Block sizes to run in KiB.", cxxopts::value<std::vector<size_t>>()->default_value("64,128,1024"))
+	("l,levels", "Compression levels to run.", cxxopts::value<std::vector<size_t>>()->default_value("1,6,9"))
+	("r,repeats", "Repeat each run `arg` times and report the fastest.", cxxopts::value<size_t>()->default_value("3"))
+	("tmpdir", "Directory for the corpora and compressed files.", cxxopts::value<std::string>()->default_value(std::filesystem::temp_directory_path().string()))
+	("o,output", "Write the JSON results to `arg` instead of stdout.", cxxopts::value<std::string>()->default_value(""))
+	("quick", "Run a small matrix that finishes in seconds: 8 MiB of text, 1 and all threads, 128 KiB blocks, level 6, once. Options given explicitly still apply.", cxxopts::value<bool>()->default_value("false"))
+	("h,help", "Print this message and quit.", cxxopts::value<bool>()->default_value("false"));
+
+    size_t corpus_size;
+    std::vector<std::string> corpora;
+    std::vector<size_t> thread_counts;
+    std::vector<size_t> block_sizes;
+    std::vector<size_t> levels;
+    size_t repeats;
+    std::filesystem::path tmpdir;
+    std::string output;
+    try {
+	const auto &args = options.parse(argc, argv);
+	if (args["help"].as<bool>()) {
+	    std::cerr << options.help() << std::endl;
+	    return 0;
+	}
+	corpus_size = args["size"].as<size_t>()*1048576;
+	corpora = args["corpora"].as<std::vector<std::string>>();
+	thread_counts = args["threads"].as<std::vector<size_t>>();
+	block_sizes = args["block-sizes"].as<std::vector<size_t>>();
+	levels = args["levels"].as<std::vector<size_t>>();
+	repeats = std::max(args["repeats"].as<size_t>(), (size_t)1);
+	tmpdir = args["tmpdir"].as<std::string>();
+	output = args["output"].as<std::string>();
+
+	if (args["quick"].as<bool>()) {
+	    // Only replace the options that were left at their defaults
+	    corpus_size = (args.count("size") ? corpus_size : 8*1048576);
+	    corpora = (args.count("corpora") ? corpora : std::vector<std::string>{ "text" });
+	    thread_counts = (args.count("threads") ? thread_counts : std::vector<size_t>{ 1, 0 });
+	    block_sizes = (args.count("block-sizes") ? block_sizes : std::vector<size_t>{ 128 });
+	    levels = (args.count("levels") ? levels : std::vector<size_t>{ 6 });
+	    repeats = (args.count("repeats") ? repeats : 1);
+	}
+    } catch (std::exception &e) {
+	std::cerr << "Parsing arguments failed:\n"
+		  << std::string("\t") + std::string(e.what()) + "\n"
+		  << "\trun tigz_bench with the --help option for usage instructions.\n";
+	std::cerr << std::endl;
+	return 1;
+    }
+
+    for (size_t &n_threads : thread_counts) {
+	n_threads = (n_threads > 0 ? n_threads : std::thread::hardware_concurrency());
+    }
+
+    const std::string &prefix = (tmpdir / ("tigz_bench_" + std::to_string(getpid()))).string();
+    const std::string &compressed_path = prefix + ".gz";
+    std::vector<Result> results;
+    for (const std::string &corpus : corpora) {
+	std::string data;
+	if (corpus == "random") {
+	    data = random_corpus(corpus_size);
+	} else if (corpus == "text") {
+	    data = text_corpus(corpus_size);
+	} else if (corpus == "fastq") {
+	    data = fastq_corpus(corpus_size);
+	} else if (corpus == "compressed") {
+	    data = compressed_corpus(corpus_size);
+	} else {
+	    std::cerr << "tigz_bench: unknown corpus `" << corpus << "`." << std::endl;
+	    return 1;
+	}
+
+	const std::string &corpus_path = prefix + "." + corpus;
+	{
+	    std::ofstream corpus_file(corpus_path, std::ios::binary);
+	    corpus_file.write(data.data(), data.size());
+	}
+	data.clear();
+	data.shrink_to_fit();
+
+	std::cerr << "tigz_bench: running " << corpus << " corpus" << std::endl;
+	for (size_t level : levels) {
+	    for (size_t block_size : block_sizes) {
+		for (size_t n_threads : thread_counts) {
+		    Result compress{ corpus, "compress", n_threads, block_size*1024, level, corpus_size, 0, 0.0, 0 };
+		    compress.seconds = best_time(repeats, &compress.peak_rss, [&]() {
+			tigz::ParallelCompressor cmp(n_threads, level, block_size*1024, block_size*1024);
+			cmp.compress_files({ corpus_path }, { compressed_path });
+		    });
+		    compress.out_nbytes = std::filesystem::file_size(compressed_path);
+		    results.emplace_back(compress);
+
+		    Result decompress{ corpus, "decompress", n_threads, block_size*1024, level, compress.out_nbytes, corpus_size, 0.0, 0 };
+		    decompress.seconds = best_time(repeats, &decompress.peak_rss, [&]() {
+			tigz::ParallelDecompressor decomp(n_threads, block_size*1024);
+			std::string out_path = "/dev/null";
+			decomp.decompress_file(compressed_path, out_path);
+		    });
+		    results.emplace_back(decompress);
+		}
+	    }
+	}
+	std::filesystem::remove(corpus_path);
+    }
+    std::filesystem::remove(compressed_path);
+
+    if (output.empty()) {
+	write_json(results, corpus_size, &std::cout);
+    } else {
+	std::ofstream out(output);
+	write_json(results, corpus_size, &out);
+    }
+
+    return 0;
+}
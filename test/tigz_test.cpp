@@ -0,0 +1,778 @@
+// BSD 3-Clause License
+//
+// Copyright (c) 2023, Tommi Mäklin
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from
+//    this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+#include <cstdint>
+#include <iostream>
+#include <sstream>
+#include <fstream>
+#include <filesystem>
+#include <random>
+#include <string>
+#include <vector>
+#include <functional>
+#include <thread>
+#include <chrono>
+#include <future>
+
+#include "zlib.h"
+#include "libdeflate.h"
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "tigz_buffer_pool.hpp"
+#include "tigz_compressor.hpp"
+#include "tigz_server.hpp"
+
+// Checks run by `ctest`. Each returns an empty string on success or a
+// description of what went wrong.
+
+size_t get_le(const std::string &data, size_t offset, size_t nbytes) {
+    size_t value = 0;
+    for (size_t i = 0; i < nbytes; ++i) {
+	value |= (size_t)(unsigned char)data[offset + i] << (8*i);
+    }
+    return value;
+}
+
+// Split BGZF data into blocks, check that each holds at most 0xff00
+// bytes and that BSIZE matches its length, and decompress them. The
+// (compressed, uncompressed) offsets of the blocks are added to
+// `offsets` if it is not a nullptr.
+std::string check_bgzf_blocks(const std::string &bgzf, std::string *decompressed,
+			      std::vector<std::pair<size_t, size_t>> *offsets = nullptr) {
+    std::unique_ptr<libdeflate_decompressor, decltype(&libdeflate_free_decompressor)>
+	decompressor(libdeflate_alloc_decompressor(), &libdeflate_free_decompressor);
+    std::vector<char> out(65536);
+    size_t offset = 0;
+    while (offset < bgzf.size()) {
+	if (bgzf.size() - offset < 28 || bgzf.compare(offset, 4, "\x1f\x8b\x08\x04") != 0 || bgzf.compare(offset + 12, 2, "BC") != 0) {
+	    return "no BGZF block at byte " + std::to_string(offset);
+	}
+	size_t block_nbytes = get_le(bgzf, offset + 16, 2) + 1;
+	if (offset + block_nbytes > bgzf.size()) {
+	    return "BSIZE of the block at byte " + std::to_string(offset) + " runs past the end";
+	}
+	size_t isize = get_le(bgzf, offset + block_nbytes - 4, 4);
+	if (isize > 0xff00) {
+	    return "the block at byte " + std::to_string(offset) + " holds " + std::to_string(isize) + " bytes";
+	}
+	size_t out_nbytes = 0;
+	if (libdeflate_gzip_decompress(decompressor.get(), bgzf.data() + offset, block_nbytes, out.data(), out.size(), &out_nbytes) != LIBDEFLATE_SUCCESS) {
+	    return "the block at byte " + std::to_string(offset) + " does not decompress";
+	}
+	if (offsets != nullptr) {
+	    offsets->emplace_back(offset, decompressed->size());
+	}
+	decompressed->append(out.data(), out_nbytes);
+	offset += block_nbytes;
+    }
+    return "";
+}
+
+// FASTQ with records whose sequences are longer than a BGZF block and
+// don't compress, between short records. They start at different
+// offsets so that some blocks end with most of a block cut from them.
+std::string long_record_fastq() {
+    std::mt19937 rng(3);
+    std::string fastq;
+    for (size_t i = 0; i < 4000; ++i) {
+	fastq += "@read" + std::to_string(i) + "\nACGTACGTAACCGGTT\n+\nIIIIIIIIIIIIIIII\n";
+	if (i % 250 == 0) {
+	    std::string sequence(70000 + 997*i, '\0');
+	    for (char &c : sequence) {
+		c = (char)(rng() % 255 + 1);
+		c = (c == '\n' ? 'N' : c);
+	    }
+	    fastq += "@long\n" + sequence + "\n+\n" + std::string(sequence.size(), 'I') + "\n";
+	}
+    }
+    return fastq;
+}
+
+std::string test_bgzf_long_records(size_t n_threads, tigz::RecordFormat record_format, int path) {
+    std::string input = long_record_fastq();
+    tigz::ParallelCompressor cmp(n_threads);
+    cmp.set_bgzf(true);
+    cmp.set_record_format(record_format);
+
+    std::string bgzf;
+    if (path == 0) {
+	std::istringstream in(input);
+	std::ostringstream out;
+	cmp.compress_stream(&in, &out);
+	bgzf = out.str();
+    } else if (path == 1) {
+	std::string in_path = (std::filesystem::temp_directory_path() / "tigz_test_long_records.fastq").string();
+	std::ofstream(in_path, std::ios::binary) << input;
+	cmp.compress_files({ in_path }, { in_path + ".gz" });
+	std::ifstream compressed(in_path + ".gz", std::ios::binary);
+	bgzf.assign(std::istreambuf_iterator<char>(compressed), std::istreambuf_iterator<char>());
+	std::filesystem::remove(in_path);
+	std::filesystem::remove(in_path + ".gz");
+    } else {
+	cmp.open([&bgzf](const char *data, size_t nbytes) { bgzf.append(data, nbytes); });
+	for (size_t i = 0; i < input.size(); i += 4096) {
+	    cmp.write(input.data() + i, std::min((size_t)4096, input.size() - i));
+	}
+	cmp.finish();
+    }
+
+    std::string decompressed;
+    std::string error = check_bgzf_blocks(bgzf, &decompressed);
+    if (error.empty() && decompressed != input) {
+	error = "the decompressed data differs from the input";
+    }
+    return error;
+}
+
+// Compress `input` to BGZF with a .gzi index, through a stream or a
+// file, and check that the index has the offsets of every block but
+// the first and the EOF marker
+std::string test_gzi(size_t n_threads, const std::string &input, bool file) {
+    tigz::ParallelCompressor cmp(n_threads);
+    cmp.set_bgzf(true);
+
+    std::string bgzf;
+    std::string gzi;
+    if (!file) {
+	std::istringstream in(input);
+	std::ostringstream out;
+	std::ostringstream gzi_out;
+	cmp.compress_stream(&in, &out, &gzi_out);
+	bgzf = out.str();
+	gzi = gzi_out.str();
+    } else {
+	std::string in_path = (std::filesystem::temp_directory_path() / "tigz_test_gzi.txt").string();
+	std::ofstream(in_path, std::ios::binary) << input;
+	cmp.compress_files({ in_path }, { in_path + ".gz" }, { in_path + ".gz.gzi" });
+	std::ifstream compressed(in_path + ".gz", std::ios::binary);
+	bgzf.assign(std::istreambuf_iterator<char>(compressed), std::istreambuf_iterator<char>());
+	std::ifstream index(in_path + ".gz.gzi", std::ios::binary);
+	gzi.assign(std::istreambuf_iterator<char>(index), std::istreambuf_iterator<char>());
+	std::filesystem::remove(in_path);
+	std::filesystem::remove(in_path + ".gz");
+	std::filesystem::remove(in_path + ".gz.gzi");
+    }
+
+    std::string decompressed;
+    std::vector<std::pair<size_t, size_t>> offsets;
+    std::string error = check_bgzf_blocks(bgzf, &decompressed, &offsets);
+    if (!error.empty()) {
+	return error;
+    }
+    if (decompressed != input) {
+	return "the decompressed data differs from the input";
+    }
+    // Drop the EOF marker and the first block, if the input was not empty
+    offsets.pop_back();
+    if (!offsets.empty()) {
+	offsets.erase(offsets.begin());
+    }
+
+    if (gzi.size() < 8 || get_le(gzi, 0, 8) != offsets.size()) {
+	return "the index does not count " + std::to_string(offsets.size()) + " entries";
+    }
+    if (gzi.size() != 8 + 16*offsets.size()) {
+	return "the index is " + std::to_string(gzi.size()) + " bytes long";
+    }
+    for (size_t i = 0; i < offsets.size(); ++i) {
+	if (get_le(gzi, 8 + 16*i, 8) != offsets[i].first || get_le(gzi, 16 + 16*i, 8) != offsets[i].second) {
+	    return "entry " + std::to_string(i) + " of the index is not the start of block " + std::to_string(i + 1);
+	}
+    }
+    return "";
+}
+
+// FASTQ records of varying lengths without a newline at the end
+std::string short_record_fastq(size_t n_records) {
+    std::mt19937 rng(5);
+    std::string fastq;
+    for (size_t i = 0; i < n_records; ++i) {
+	size_t length = 20 + rng() % 300;
+	std::string sequence(length, 'A');
+	for (char &c : sequence) {
+	    c = "ACGT"[rng() % 4];
+	}
+	fastq += "@read" + std::to_string(i) + "\n" + sequence + "\n+\n" + std::string(length, 'I') + (i + 1 < n_records ? "\n" : "");
+    }
+    return fastq;
+}
+
+// Compress FASTQ with records kept within members and check that the
+// .ridx lists each member's offset with the number of the first record
+// that starts in it, followed by the end of the data and the total
+std::string test_record_index(size_t n_threads, tigz::RecordFormat record_format, bool bgzf) {
+    std::string input = short_record_fastq(20000);
+    tigz::ParallelCompressor cmp(n_threads, 6, 65536, 65536);
+    cmp.set_bgzf(bgzf);
+    cmp.set_record_format(record_format);
+    std::istringstream in(input);
+    std::ostringstream out;
+    std::ostringstream index_out;
+    cmp.compress_stream(&in, &out, nullptr, &index_out);
+    std::string compressed = out.str();
+    std::string index = index_out.str();
+
+    // Offsets of the records in the input
+    size_t lines_per_record = (record_format == tigz::RecordFormat::fastq ? 4 : 1);
+    std::vector<size_t> record_starts;
+    size_t n_lines = 0;
+    size_t line_start = 0;
+    while (line_start < input.size()) {
+	if (n_lines++ % lines_per_record == 0) {
+	    record_starts.push_back(line_start);
+	}
+	size_t line_end = input.find('\n', line_start);
+	line_start = (line_end == std::string::npos ? input.size() : line_end + 1);
+    }
+
+    // Expected entries from the members, without the BGZF EOF marker
+    std::unique_ptr<libdeflate_decompressor, decltype(&libdeflate_free_decompressor)>
+	decompressor(libdeflate_alloc_decompressor(), &libdeflate_free_decompressor);
+    std::vector<char> member(1048576);
+    std::vector<std::pair<size_t, size_t>> expected;
+    size_t compressed_offset = 0;
+    size_t uncompressed_offset = 0;
+    while (compressed_offset < compressed.size()) {
+	size_t in_nbytes = 0;
+	size_t out_nbytes = 0;
+	if (libdeflate_gzip_decompress_ex(decompressor.get(), compressed.data() + compressed_offset, compressed.size() - compressed_offset,
+					  member.data(), member.size(), &in_nbytes, &out_nbytes) != LIBDEFLATE_SUCCESS) {
+	    return "the member at byte " + std::to_string(compressed_offset) + " does not decompress";
+	}
+	if (out_nbytes > 0) {
+	    size_t first_record = std::lower_bound(record_starts.begin(), record_starts.end(), uncompressed_offset) - record_starts.begin();
+	    expected.emplace_back(compressed_offset, first_record);
+	}
+	compressed_offset += in_nbytes;
+	uncompressed_offset += out_nbytes;
+    }
+    if (uncompressed_offset != input.size()) {
+	return "the members decompress to " + std::to_string(uncompressed_offset) + " bytes";
+    }
+    expected.emplace_back(compressed.size() - (bgzf ? 28 : 0), record_starts.size());
+
+    if (index.size() != 8 + 16*expected.size() || get_le(index, 0, 8) != expected.size() - 1) {
+	return "the index does not have " + std::to_string(expected.size() - 1) + " entries and the total";
+    }
+    for (size_t i = 0; i < expected.size(); ++i) {
+	size_t offset = get_le(index, 8 + 16*i, 8);
+	size_t first_record = get_le(index, 16 + 16*i, 8);
+	if (offset != expected[i].first || first_record != expected[i].second) {
+	    return "entry " + std::to_string(i) + " is (" + std::to_string(offset) + ", " + std::to_string(first_record) + ") instead of (" +
+		std::to_string(expected[i].first) + ", " + std::to_string(expected[i].second) + ")";
+	}
+    }
+    return "";
+}
+
+// Compressible text of `nbytes` made of words repeated over the whole
+// input, so that the dictionary of each block matters
+std::string text_input(size_t nbytes) {
+    const char *words[] = { "deflate ", "stream ", "block ", "window ", "dictionary ", "member\n", "thread ", "prime " };
+    std::mt19937 rng(7);
+    std::string text;
+    while (text.size() < nbytes) {
+	text += words[rng() % 8];
+    }
+    text.resize(nbytes);
+    return text;
+}
+
+// Compress `input` with dictionary priming in blocks of `block_nbytes`
+// and check that the output is a single gzip member of it
+std::string test_dictionary(size_t n_threads, const std::string &input, size_t block_nbytes) {
+    tigz::ParallelCompressor cmp(n_threads, 6, block_nbytes, block_nbytes);
+    cmp.set_dictionary(true);
+    std::istringstream in(input);
+    std::ostringstream out;
+    cmp.compress_stream(&in, &out);
+    std::string gz = out.str();
+
+    std::unique_ptr<libdeflate_decompressor, decltype(&libdeflate_free_decompressor)>
+	decompressor(libdeflate_alloc_decompressor(), &libdeflate_free_decompressor);
+    std::vector<char> decompressed(input.size() + 1);
+    size_t in_nbytes = 0;
+    size_t out_nbytes = 0;
+    if (libdeflate_gzip_decompress_ex(decompressor.get(), gz.data(), gz.size(), decompressed.data(), decompressed.size(), &in_nbytes, &out_nbytes) != LIBDEFLATE_SUCCESS) {
+	return "the output does not decompress";
+    }
+    if (in_nbytes != gz.size()) {
+	return "the output is not a single gzip member";
+    }
+    if (input.compare(0, std::string::npos, decompressed.data(), out_nbytes) != 0) {
+	return "the decompressed data differs from the input";
+    }
+    return "";
+}
+
+// Random bytes that don't compress, so that libdeflate writes stored
+// blocks
+std::string random_input(size_t nbytes) {
+    std::mt19937 rng(11);
+    std::string data(nbytes, '\0');
+    for (size_t i = 0; i < nbytes; ++i) {
+	data[i] = (char)(rng() & 0xff);
+    }
+    return data;
+}
+
+// Compress `input` to a zlib or raw deflate stream at `level` and check
+// with libdeflate that it is a single stream of it. For zlib this also
+// checks the combined adler32 in the trailer.
+std::string test_single_stream(size_t n_threads, tigz::Format format, size_t level, const std::string &input, size_t block_nbytes) {
+    tigz::ParallelCompressor cmp(n_threads, level, block_nbytes, block_nbytes);
+    cmp.set_format(format);
+    std::istringstream in(input);
+    std::ostringstream out;
+    cmp.compress_stream(&in, &out);
+    std::string compressed = out.str();
+
+    std::unique_ptr<libdeflate_decompressor, decltype(&libdeflate_free_decompressor)>
+	decompressor(libdeflate_alloc_decompressor(), &libdeflate_free_decompressor);
+    std::vector<char> decompressed(input.size() + 1);
+    size_t in_nbytes = 0;
+    size_t out_nbytes = 0;
+    libdeflate_result result = (format == tigz::Format::zlib ?
+				libdeflate_zlib_decompress_ex(decompressor.get(), compressed.data(), compressed.size(), decompressed.data(), decompressed.size(), &in_nbytes, &out_nbytes) :
+				libdeflate_deflate_decompress_ex(decompressor.get(), compressed.data(), compressed.size(), decompressed.data(), decompressed.size(), &in_nbytes, &out_nbytes));
+    if (result != LIBDEFLATE_SUCCESS) {
+	return "the output does not decompress";
+    }
+    if (in_nbytes != compressed.size()) {
+	return "the output is not a single stream";
+    }
+    if (input.compare(0, std::string::npos, decompressed.data(), out_nbytes) != 0) {
+	return "the decompressed data differs from the input";
+    }
+    return "";
+}
+
+// Levels above 9 can't prime zlib with a dictionary, so they are
+// rejected with zlib or raw deflate output
+std::string test_single_stream_dictionary_level() {
+    tigz::ParallelCompressor cmp(1, 12);
+    cmp.set_format(tigz::Format::zlib);
+    cmp.set_dictionary(true);
+    std::istringstream in("tigz");
+    std::ostringstream out;
+    try {
+	cmp.compress_stream(&in, &out);
+    } catch (const std::invalid_argument &) {
+	return "";
+    }
+    return "level 12 with a dictionary and zlib output did not throw";
+}
+
+// Decompress `data` with zlib, which unlike libdeflate also decodes a
+// stream that ends at a flush point, and gzip members one after another.
+// `window_bits` selects the format like for inflateInit2.
+std::string inflate_prefix(const std::string &data, int window_bits, std::string *decompressed) {
+    z_stream strm = {};
+    if (inflateInit2(&strm, window_bits) != Z_OK) {
+	return "inflateInit2 failed";
+    }
+    strm.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+    strm.avail_in = data.size();
+    std::vector<char> out(65536);
+    int ret = Z_OK;
+    while (true) {
+	strm.next_out = reinterpret_cast<Bytef*>(out.data());
+	strm.avail_out = out.size();
+	ret = inflate(&strm, Z_SYNC_FLUSH);
+	decompressed->append(out.data(), out.size() - strm.avail_out);
+	if (ret == Z_STREAM_END && strm.avail_in > 0) {
+	    (void)inflateReset(&strm);
+	} else if (ret != Z_OK || (strm.avail_in == 0 && strm.avail_out > 0)) {
+	    break;
+	}
+    }
+    (void)inflateEnd(&strm);
+    if ((ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) || strm.avail_in > 0) {
+	return "the output does not decompress";
+    }
+    return "";
+}
+
+// Push `input` through `open`, `write`, and `finish`, flushing after
+// `flush_at` bytes and checking that the output until then decompresses
+// to exactly the input written before the flush
+std::string test_push_flush(size_t n_threads, tigz::Format format, bool dictionary, bool bgzf, const std::string &input, size_t flush_at) {
+    tigz::ParallelCompressor cmp(n_threads, 6, 65536, 65536);
+    cmp.set_format(format);
+    cmp.set_dictionary(dictionary);
+    cmp.set_bgzf(bgzf);
+    int window_bits = (format == tigz::Format::gzip ? 31 : (format == tigz::Format::zlib ? 15 : -15));
+
+    std::string compressed;
+    cmp.open([&compressed](const char *data, size_t nbytes) { compressed.append(data, nbytes); });
+    for (size_t i = 0; i < flush_at; i += 10000) {
+	cmp.write(input.data() + i, std::min((size_t)10000, flush_at - i));
+    }
+    cmp.flush();
+    std::string decompressed;
+    std::string error = inflate_prefix(compressed, window_bits, &decompressed);
+    if (!error.empty()) {
+	return "after the flush: " + error;
+    }
+    if (decompressed != input.substr(0, flush_at)) {
+	return "the output after the flush decompresses to " + std::to_string(decompressed.size()) + " bytes instead of " + std::to_string(flush_at);
+    }
+
+    cmp.write(input.data() + flush_at, input.size() - flush_at);
+    cmp.finish();
+    decompressed.clear();
+    error = inflate_prefix(compressed, window_bits, &decompressed);
+    if (!error.empty()) {
+	return "after finish: " + error;
+    }
+    if (decompressed != input) {
+	return "the decompressed data differs from the input";
+    }
+    return "";
+}
+
+// Abort a stream halfway and compress another one with the same
+// compressor, and check that opening a stream twice throws
+std::string test_push_reuse(size_t n_threads, tigz::Format format, bool dictionary) {
+    tigz::ParallelCompressor cmp(n_threads, 6, 65536, 65536);
+    cmp.set_format(format);
+    cmp.set_dictionary(dictionary);
+    int window_bits = (format == tigz::Format::gzip ? 31 : (format == tigz::Format::zlib ? 15 : -15));
+    std::string input = text_input(1000000);
+
+    std::string aborted;
+    cmp.open([&aborted](const char *data, size_t nbytes) { aborted.append(data, nbytes); });
+    cmp.write(input.data(), input.size()/2);
+    cmp.abort();
+
+    std::string compressed;
+    cmp.open([&compressed](const char *data, size_t nbytes) { compressed.append(data, nbytes); });
+    try {
+	cmp.open([](const char*, size_t) {});
+	return "opening a second stream did not throw";
+    } catch (const std::logic_error &) {
+	// The first stream stays open
+    }
+    cmp.write(input.data(), input.size());
+    cmp.finish();
+
+    std::string decompressed;
+    std::string error = inflate_prefix(compressed, window_bits, &decompressed);
+    if (!error.empty()) {
+	return error;
+    }
+    if (decompressed != input) {
+	return "the stream after the aborted one decompresses to different data";
+    }
+    return "";
+}
+
+// Buffers of a pool with a limit stay within it: `try_acquire` fails
+// and `acquire` waits while a buffer would not fit, unless
+// `exceed_limit` is set, and memory over the limit is freed on return
+std::string test_buffer_pool_limit() {
+    const size_t limit = 1048576;
+    std::shared_ptr<tigz::BufferPool> pool = std::make_shared<tigz::BufferPool>(limit);
+    tigz::Buffer first = pool->acquire(655360);
+    tigz::Buffer second;
+    if (pool->try_acquire(655360, &second)) {
+	return "try_acquire went over the limit";
+    }
+
+    std::future<tigz::Buffer> waiting = std::async(std::launch::async, [&pool]() { return pool->acquire(655360); });
+    if (waiting.wait_for(std::chrono::milliseconds(200)) != std::future_status::timeout) {
+	return "acquire did not wait for memory under the limit";
+    }
+    first = tigz::Buffer();
+    if (waiting.wait_for(std::chrono::seconds(10)) != std::future_status::ready) {
+	return "acquire did not take the returned memory";
+    }
+    second = waiting.get();
+
+    tigz::Buffer over = pool->acquire(655360, true);
+    if (over.size() < 655360 || pool->allocated() <= limit) {
+	return "acquire with exceed_limit did not allocate over the limit";
+    }
+    over = tigz::Buffer();
+    if (pool->allocated() > limit) {
+	return "the memory over the limit was not freed on return";
+    }
+    second = tigz::Buffer();
+    if (pool->allocated() > limit || pool->cached_size() != pool->allocated()) {
+	return "the returned buffers are not cached within the limit";
+    }
+    return "";
+}
+
+// Without a limit, returned buffers are cached for reuse, but not more
+// than a bounded amount of them
+std::string test_buffer_pool_cache() {
+    std::shared_ptr<tigz::BufferPool> pool = std::make_shared<tigz::BufferPool>();
+    char *small = nullptr;
+    {
+	tigz::Buffer buffer = pool->acquire(65536);
+	small = buffer.data();
+    }
+    {
+	tigz::Buffer larger = pool->acquire(262144);
+    }
+    tigz::Buffer again = pool->acquire(65536);
+    if (again.data() != small) {
+	return "a cached buffer was not reused";
+    }
+    again = tigz::Buffer();
+
+    // Anonymous mappings cost no memory until they are written to
+    std::vector<tigz::Buffer> buffers;
+    for (size_t i = 0; i < 64; ++i) {
+	buffers.push_back(pool->acquire(67108864));
+    }
+    buffers.clear();
+    if (pool->cached_size() >= (size_t)64*67108864 || pool->cached_size() != pool->allocated()) {
+	return "the cache kept " + std::to_string(pool->cached_size()) + " bytes of free buffers";
+    }
+    return "";
+}
+
+// Temporary file that is removed when it goes out of scope
+struct TempFile {
+    std::string path;
+    int fd;
+
+    TempFile(const std::string &contents = "") {
+	char name[] = "/tmp/tigz_test_XXXXXX";
+	this->fd = mkstemp(name);
+	this->path = name;
+	if (write(this->fd, contents.data(), contents.size()) != (ssize_t)contents.size() || lseek(this->fd, 0, SEEK_SET) != 0) {
+	    throw std::runtime_error("can't write " + this->path);
+	}
+    }
+    ~TempFile() {
+	close(this->fd);
+	unlink(this->path.c_str());
+    }
+
+    std::string read_all() const {
+	std::ifstream in(this->path, std::ios::binary);
+	std::ostringstream contents;
+	contents << in.rdbuf();
+	return contents.str();
+    }
+};
+
+// Send `request` for `in_fd` and `out_fd` to `server` over a
+// socketpair, returns the error of the job or an empty string
+std::string run_on_socketpair(tigz::Server &server, const tigz::ServerRequest &request, int in_fd, int out_fd) {
+    int sockets[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sockets) != 0) {
+	return "socketpair failed";
+    }
+    std::thread serving([&server, &sockets]() { server.handle_connection(sockets[0]); });
+    std::string error;
+    try {
+	tigz::run_on_connection(sockets[1], request, in_fd, out_fd);
+    } catch (const std::runtime_error &e) {
+	error = e.what();
+	if (error.empty()) {
+	    error = "the job failed without a message";
+	}
+    }
+    serving.join();
+    close(sockets[1]);
+    return error;
+}
+
+// Compress `input` on the server over a socketpair, check the output
+// with zlib, and decompress it back on the server. Inputs of at least
+// `large_input_nbytes` are compressed with the shared engines.
+std::string test_server_round_trip(tigz::Format format, const std::string &input, size_t large_input_nbytes) {
+    tigz::Server server("/tmp/tigz_test.sock", 2, 65536);
+    server.set_large_inputs(4, large_input_nbytes);
+    tigz::ServerRequest request;
+    request.format = static_cast<uint8_t>(format);
+
+    TempFile in(input);
+    TempFile compressed;
+    std::string error = run_on_socketpair(server, request, in.fd, compressed.fd);
+    if (!error.empty()) {
+	return "compressing: " + error;
+    }
+    std::string decompressed;
+    int window_bits = (format == tigz::Format::gzip ? 31 : (format == tigz::Format::zlib ? 15 : -15));
+    error = inflate_prefix(compressed.read_all(), window_bits, &decompressed);
+    if (!error.empty()) {
+	return error;
+    }
+    if (decompressed != input) {
+	return "the compressed output decompresses to different data";
+    }
+
+    request.mode = tigz::ServerRequest::decompress;
+    TempFile compressed_in(compressed.read_all());
+    TempFile out;
+    error = run_on_socketpair(server, request, compressed_in.fd, out.fd);
+    if (!error.empty()) {
+	return "decompressing: " + error;
+    }
+    if (out.read_all() != input) {
+	return "the server decompressed different data";
+    }
+    return "";
+}
+
+// A job with an invalid request or a corrupt input gets an error reply,
+// and the lane can run the next job
+std::string test_server_errors() {
+    tigz::Server server("/tmp/tigz_test.sock", 1, 65536);
+    TempFile in(text_input(100000));
+    TempFile out;
+
+    tigz::ServerRequest request;
+    request.version = tigz::ServerRequest::protocol_version + 1;
+    if (run_on_socketpair(server, request, in.fd, out.fd).find("versions differ") == std::string::npos) {
+	return "a request with another version did not fail";
+    }
+    request = tigz::ServerRequest();
+    request.level = 13;
+    if (run_on_socketpair(server, request, in.fd, out.fd).find("invalid request") == std::string::npos) {
+	return "a request with level 13 did not fail";
+    }
+    request = tigz::ServerRequest();
+    request.mode = tigz::ServerRequest::decompress;
+    TempFile corrupt(std::string("\x1f\x8b\x08\x00", 4) + text_input(1000));
+    if (run_on_socketpair(server, request, corrupt.fd, out.fd).empty()) {
+	return "decompressing a corrupt input did not fail";
+    }
+
+    request = tigz::ServerRequest();
+    TempFile compressed;
+    std::string error = run_on_socketpair(server, request, in.fd, compressed.fd);
+    if (!error.empty()) {
+	return "the job after the errors failed: " + error;
+    }
+    return "";
+}
+
+int main() {
+    size_t n_failed = 0;
+    const auto report = [&n_failed](const std::string &name, const std::string &error) {
+	std::cerr << (error.empty() ? "ok     " : "FAILED ") << name << (error.empty() ? "" : ": " + error) << std::endl;
+	n_failed += !error.empty();
+    };
+
+    const char *path_names[] = { "stream", "file", "push" };
+    for (size_t n_threads : { 1, 4 }) {
+	for (tigz::RecordFormat record_format : { tigz::RecordFormat::lines, tigz::RecordFormat::fastq }) {
+	    for (int path = 0; path < 3; ++path) {
+		report(std::string("bgzf_long_records ") + std::to_string(n_threads) + " threads, " +
+		       (record_format == tigz::RecordFormat::lines ? "lines" : "fastq") + ", " + path_names[path],
+		       test_bgzf_long_records(n_threads, record_format, path));
+	    }
+	}
+    }
+
+    for (size_t n_threads : { 1, 4 }) {
+	for (size_t input_nbytes : { (size_t)0, (size_t)1000, (size_t)5000000 }) {
+	    for (bool file : { false, true }) {
+		report("gzi " + std::to_string(n_threads) + " threads, " + std::to_string(input_nbytes) + " bytes, " + (file ? "file" : "stream"),
+		       test_gzi(n_threads, text_input(input_nbytes), file));
+	    }
+	}
+    }
+
+    const size_t block_nbytes = 65536;
+    for (size_t n_threads : { 1, 4 }) {
+	for (size_t input_nbytes : { (size_t)0, block_nbytes, 20*block_nbytes + 1234 }) {
+	    report("dictionary " + std::to_string(n_threads) + " threads, " + std::to_string(input_nbytes) + " bytes",
+		   test_dictionary(n_threads, text_input(input_nbytes), block_nbytes));
+	}
+    }
+
+    for (size_t n_threads : { 1, 4 }) {
+	for (tigz::Format format : { tigz::Format::zlib, tigz::Format::deflate }) {
+	    for (size_t level : { 0, 1, 6, 9, 12 }) {
+		for (size_t input_nbytes : { (size_t)0, (size_t)1000, block_nbytes, 20*block_nbytes + 1234 }) {
+		    for (bool random : { false, true }) {
+			report(std::string("single_stream ") + std::to_string(n_threads) + " threads, " +
+			       (format == tigz::Format::zlib ? "zlib" : "deflate") + ", level " + std::to_string(level) + ", " +
+			       std::to_string(input_nbytes) + (random ? " random bytes" : " bytes"),
+			       test_single_stream(n_threads, format, level, (random ? random_input(input_nbytes) : text_input(input_nbytes)), block_nbytes));
+		    }
+		}
+	    }
+	}
+    }
+    report("single_stream dictionary level", test_single_stream_dictionary_level());
+
+    struct { const char *name; tigz::Format format; bool dictionary; bool bgzf; } modes[] = {
+	{ "gzip", tigz::Format::gzip, false, false },
+	{ "bgzf", tigz::Format::gzip, false, true },
+	{ "dictionary", tigz::Format::gzip, true, false },
+	{ "zlib", tigz::Format::zlib, false, false },
+	{ "deflate", tigz::Format::deflate, false, false },
+    };
+    for (size_t n_threads : { 1, 4 }) {
+	for (const auto &mode : modes) {
+	    std::string input = text_input(1000000);
+	    for (size_t flush_at : { (size_t)0, (size_t)1000, 5*block_nbytes, (size_t)654321 }) {
+		report(std::string("push_flush ") + std::to_string(n_threads) + " threads, " + mode.name + ", flush at " + std::to_string(flush_at),
+		       test_push_flush(n_threads, mode.format, mode.dictionary, mode.bgzf, input, flush_at));
+	    }
+	    if (!mode.bgzf) {
+		report(std::string("push_reuse ") + std::to_string(n_threads) + " threads, " + mode.name,
+		       test_push_reuse(n_threads, mode.format, mode.dictionary));
+	    }
+	}
+    }
+
+    for (size_t n_threads : { 1, 4 }) {
+	for (tigz::RecordFormat record_format : { tigz::RecordFormat::lines, tigz::RecordFormat::fastq }) {
+	    for (bool bgzf : { false, true }) {
+		report(std::string("record_index ") + std::to_string(n_threads) + " threads, " +
+		       (record_format == tigz::RecordFormat::lines ? "lines" : "fastq") + (bgzf ? ", bgzf" : ", gzip"),
+		       test_record_index(n_threads, record_format, bgzf));
+	    }
+	}
+    }
+
+    for (tigz::Format format : { tigz::Format::gzip, tigz::Format::zlib }) {
+	for (size_t input_nbytes : { (size_t)0, (size_t)100000, (size_t)3000000 }) {
+	    report(std::string("server ") + (format == tigz::Format::gzip ? "gzip" : "zlib") + ", " + std::to_string(input_nbytes) + " bytes",
+		   test_server_round_trip(format, text_input(input_nbytes), 2000000));
+	}
+    }
+    report("server errors", test_server_errors());
+
+    report("buffer_pool limit", test_buffer_pool_limit());
+    report("buffer_pool cache", test_buffer_pool_cache());
+    return (n_failed == 0 ? 0 : 1);
+}